@@ -1,2 +1,4 @@
 ScriptObjects = Define.Objects{ Sources = Item '*.cxx' }
 
+ScriptBenchmark = Define.Executable{ Name = 'benchmark', Sources = Item 'benchmark/benchmark.cxx', Objects = ScriptObjects, LinkFlags = ' -llua -pthread' }
+ScriptReplay = Define.Executable{ Name = 'replay', Sources = Item 'benchmark/replay.cxx', Objects = ScriptObjects, LinkFlags = ' -llua -pthread' }
@@ -0,0 +1,330 @@
+#include "../script.h"
+#include "../databuilder.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+
+// Scripting layer benchmarks
+/*
+-- Usage: benchmark [name filter]
+-- Prints one JSON object per line: name, operations, ns/op, allocations/op (C++ heap and Lua allocator) and MB/s where
+	the benchmark processes a measurable amount of data.  Each benchmark is run several times and the fastest run is reported.
+*/
+
+// Allocation counting
+static std::atomic<unsigned long> Allocations(0);
+
+void *operator new(size_t Size)
+{
+	Allocations++;
+	void *Out = malloc(Size ? Size : 1);
+	if (!Out) throw std::bad_alloc();
+	return Out;
+}
+void *operator new[](size_t Size) { return operator new(Size); }
+void operator delete(void *Data) noexcept { free(Data); }
+void operator delete[](void *Data) noexcept { free(Data); }
+void operator delete(void *Data, size_t) noexcept { free(Data); }
+void operator delete[](void *Data, size_t) noexcept { free(Data); }
+
+struct LuaAllocator
+{
+	lua_Alloc Base;
+	void *BaseData;
+};
+
+static void *CountLuaAllocation(void *Data, void *Pointer, size_t OldSize, size_t NewSize)
+{
+	LuaAllocator &Allocator = *(LuaAllocator *)Data;
+	if (NewSize > 0) Allocations++;
+	return Allocator.Base(Allocator.BaseData, Pointer, OldSize, NewSize);
+}
+
+// Wraps the state's allocator so Lua allocations are counted too
+static void CountAllocations(Script &State, LuaAllocator &Allocator)
+{
+	Allocator.Base = lua_getallocf(State.GetState(), &Allocator.BaseData);
+	lua_setallocf(State.GetState(), CountLuaAllocation, &Allocator);
+}
+
+// Harness
+static unsigned int const Repetitions = 3;
+static String Filter;
+
+// Body performs Operations operations and returns the number of bytes processed (0 if not applicable)
+template <typename BodyType> void Measure(String const &Name, unsigned long Operations, BodyType const &Body)
+{
+	if (!Filter.empty() && (Name.find(Filter) == String::npos)) return;
+
+	double BestNanoseconds = 0;
+	unsigned long BestAllocations = 0;
+	size_t Bytes = 0;
+	for (unsigned int Repetition = 0; Repetition < Repetitions; Repetition++)
+	{
+		unsigned long const InitialAllocations = Allocations;
+		auto Start = std::chrono::steady_clock::now();
+		Bytes = Body();
+		auto End = std::chrono::steady_clock::now();
+		unsigned long const RunAllocations = Allocations - InitialAllocations;
+		double Nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(End - Start).count();
+		if ((Repetition == 0) || (Nanoseconds < BestNanoseconds))
+		{
+			BestNanoseconds = Nanoseconds;
+			BestAllocations = RunAllocations;
+		}
+	}
+
+	std::cout << "{\"name\": \"" << Name << "\", \"operations\": " << Operations <<
+		", \"ns_per_op\": " << (BestNanoseconds / Operations) <<
+		", \"allocations_per_op\": " << ((double)BestAllocations / Operations);
+	if (Bytes > 0) std::cout << ", \"mb_per_s\": " << ((Bytes / 1048576.0) / (BestNanoseconds / 1000000000.0));
+	std::cout << "}" << std::endl;
+}
+
+static String TemporaryFilename(String const &Name)
+{
+	char const *Directory = getenv("TMPDIR");
+	return String(Directory ? Directory : "/tmp") + "/renscript_benchmark_" + Name + ".lua";
+}
+
+static size_t WriteFile(String const &Filename, String const &Contents)
+{
+	std::ofstream File(Filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	File.write(Contents.data(), Contents.size());
+	return Contents.size();
+}
+
+static void BuildEntry(ScriptDataBuilder &Builder, unsigned int Index)
+{
+	Vector Position;
+	Position[0] = Index; Position[1] = 1; Position[2] = 2;
+	Builder.Key(Index).Table();
+	Builder.Key("Name").Value(String("Entry ") + AsString(Index));
+	Builder.Key("Weight").Value((float)Index * 0.5f);
+	Builder.Key("Enabled").Value(Index % 2 == 0);
+	Builder.Key("Position").Value(Position);
+	Builder.EndTable();
+}
+
+static String BuildData(unsigned int Entries)
+{
+	MemoryStream Out;
+	ScriptDataBuilder Builder(Out, 0);
+	Builder.Table();
+	for (unsigned int Index = 1; Index <= Entries; Index++)
+		BuildEntry(Builder, Index);
+	Builder.EndTable();
+	return Out;
+}
+
+int main(int ArgumentCount, char **Arguments)
+{
+	if (ArgumentCount > 1) Filter = Arguments[1];
+
+	LuaAllocator Allocator; // Declared first, the state calls it until it's closed
+	Script State;
+	CountAllocations(State, Allocator);
+
+	// Stack round trips
+	unsigned long const RoundTrips = 1000000;
+	Measure("push_get/integer", RoundTrips, [&](void)
+	{
+		for (unsigned long Index = 0; Index < RoundTrips; Index++) { State.PushInteger(Index); State.GetInteger(); }
+		return 0;
+	});
+	Measure("push_get/float", RoundTrips, [&](void)
+	{
+		for (unsigned long Index = 0; Index < RoundTrips; Index++) { State.PushFloat(Index); State.GetFloat(); }
+		return 0;
+	});
+	Measure("push_get/boolean", RoundTrips, [&](void)
+	{
+		for (unsigned long Index = 0; Index < RoundTrips; Index++) { State.PushBoolean(Index % 2); State.GetBoolean(); }
+		return 0;
+	});
+	String const ShortString = "Weight";
+	Measure("push_get/string", RoundTrips, [&](void)
+	{
+		for (unsigned long Index = 0; Index < RoundTrips; Index++) { State.PushString(ShortString); State.GetString(); }
+		return 0;
+	});
+	Measure("push_get/vector", RoundTrips, [&](void)
+	{
+		for (unsigned long Index = 0; Index < RoundTrips; Index++)
+		{
+			State.PushTable();
+			State.PushFloat(1); State.PutElement(1);
+			State.PushFloat(2); State.PutElement(2);
+			State.PushFloat(3); State.PutElement(3);
+			State.GetVector();
+		}
+		return 0;
+	});
+
+	// Table element access
+	State.PushTable();
+	State.PushFloat(1); State.PutElement("Weight");
+	Measure("pull_element/string", RoundTrips, [&](void)
+	{
+		for (unsigned long Index = 0; Index < RoundTrips; Index++) { State.PullElement("Weight"); State.GetFloat(); }
+		return 0;
+	});
+	Measure("try_element/hit", RoundTrips, [&](void)
+	{
+		for (unsigned long Index = 0; Index < RoundTrips; Index++) { if (State.TryElement("Weight")) State.GetFloat(); }
+		return 0;
+	});
+	Measure("try_element/miss", RoundTrips, [&](void)
+	{
+		for (unsigned long Index = 0; Index < RoundTrips; Index++) State.TryElement("Height");
+		return 0;
+	});
+	State.Pop();
+
+	// Iteration
+	for (unsigned int TableSize : {16u, 1000000u})
+	{
+		String const Suffix = "/" + AsString(TableSize);
+		unsigned long const Passes = 1000000 / TableSize;
+		State.PushTable();
+		for (unsigned int Index = 1; Index <= TableSize; Index++) { State.PushFloat(Index); State.PutElement(Index); }
+
+		Measure("iterate" + Suffix, Passes * TableSize, [&](void)
+		{
+			double Sum = 0;
+			for (unsigned long Pass = 0; Pass < Passes; Pass++)
+				State.Iterate([&](Script &State) { Sum += State.GetFloat(); return true; });
+			return 0;
+		});
+		Measure("for_each" + Suffix, Passes * TableSize, [&](void)
+		{
+			double Sum = 0;
+			for (unsigned long Pass = 0; Pass < Passes; Pass++)
+				State.ForEach([&](Script &State) { Sum += State.GetFloat(); return true; });
+			return 0;
+		});
+		Measure("for_each_index" + Suffix, Passes * TableSize, [&](void)
+		{
+			double Sum = 0;
+			for (unsigned long Pass = 0; Pass < Passes; Pass++)
+				State.ForEachIndex([&](Script &State, int) { Sum += State.GetFloat(); return true; });
+			return 0;
+		});
+		Measure("for_each_pair" + Suffix, Passes * TableSize, [&](void)
+		{
+			double Sum = 0;
+			for (unsigned long Pass = 0; Pass < Passes; Pass++)
+				State.ForEachPair([&](ScriptValue const &, ScriptValue const &Value) { Sum += Value.GetFloat(); return true; });
+			return 0;
+		});
+		State.Pop();
+	}
+
+	// Hooks
+	String const HookFilename = TemporaryFilename("hook");
+	WriteFile(HookFilename, "return function(...) return select('#', ...) end\n");
+	State.ClearStack();
+	if (!State.Do(HookFilename, false))
+	{
+		remove(HookFilename.c_str());
+		return 1;
+	}
+	State.SaveInternal("BenchmarkHook");
+	unsigned long const Calls = 200000;
+	for (int ArgumentCount : {0, 1, 4, 8})
+	{
+		Measure("call_hook/" + AsString(ArgumentCount), Calls, [&](void)
+		{
+			for (unsigned long Call = 0; Call < Calls; Call++)
+			{
+				for (int Argument = 0; Argument < ArgumentCount; Argument++) State.PushFloat(Argument);
+				State.CallHook("BenchmarkHook", ArgumentCount);
+				State.ClearStack();
+			}
+			return 0;
+		});
+	}
+	State.MemoizeHook("BenchmarkHook", 64);
+	Measure("call_hook/memoized", Calls, [&](void)
+	{
+		for (unsigned long Call = 0; Call < Calls; Call++)
+		{
+			State.PushFloat(Call % 16);
+			State.CallHook("BenchmarkHook", 1);
+			State.ClearStack();
+		}
+		return 0;
+	});
+	State.InvalidateHooks();
+	State.PushInternal("BenchmarkHook");
+	ScriptReference HookReference = State.SaveReference();
+	Measure("call_hook/reference", Calls, [&](void)
+	{
+		for (unsigned long Call = 0; Call < Calls; Call++)
+		{
+			State.CallHook(HookReference, 0);
+			State.ClearStack();
+		}
+		return 0;
+	});
+
+	// Calling registered C++ functions from Lua
+	State.PushFunction([](Script &) { return 0; });
+	State.SaveGlobal("BenchmarkFunction");
+	String const FunctionFilename = TemporaryFilename("function");
+	WriteFile(FunctionFilename, "for Index = 1, " + AsString(Calls) + " do BenchmarkFunction() end\n");
+	Measure("push_function/call", Calls, [&](void)
+	{
+		State.ClearStack();
+		State.Do(FunctionFilename, false);
+		return 0;
+	});
+
+	// Loading files
+	String const SmallFilename = TemporaryFilename("small");
+	size_t const SmallSize = WriteFile(SmallFilename, "return {Name = \"Small\", Weight = 1}\n");
+	Measure("do/small", 1000, [&](void)
+	{
+		for (unsigned int Run = 0; Run < 1000; Run++) { State.ClearStack(); State.Do(SmallFilename, false); }
+		return SmallSize * 1000;
+	});
+	String const LargeFilename = TemporaryFilename("large");
+	size_t const LargeSize = WriteFile(LargeFilename, "return " + BuildData(20000) + "\n");
+	Measure("do/large", 1, [&](void)
+	{
+		State.ClearStack();
+		State.Do(LargeFilename, false);
+		return LargeSize;
+	});
+	State.ClearStack();
+
+	// Data building
+	unsigned int const Entries = 20000;
+	Measure("data_builder/serial", Entries, [&](void) { return BuildData(Entries).size(); });
+	Measure("data_builder/fork", Entries, [&](void)
+	{
+		unsigned int const BranchCount = 16;
+		MemoryStream Out;
+		ScriptDataBuilder Builder(Out, 0);
+		std::vector<ScriptDataBuilder::BranchFunction> Branches;
+		for (unsigned int Branch = 0; Branch < BranchCount; Branch++)
+			Branches.push_back([=](ScriptDataBuilder &Builder)
+			{
+				for (unsigned int Index = Branch * (Entries / BranchCount) + 1; Index <= (Branch + 1) * (Entries / BranchCount); Index++)
+					BuildEntry(Builder, Index);
+			});
+		Builder.Table().Fork(Branches).EndTable();
+		return ((String)Out).size();
+	});
+
+	remove(HookFilename.c_str());
+	remove(FunctionFilename.c_str());
+	remove(SmallFilename.c_str());
+	remove(LargeFilename.c_str());
+	return 0;
+}
@@ -0,0 +1,52 @@
+#include "../scripttrace.h"
+
+#include <iostream>
+
+// Replays a trace recorded with Script::StartRecording
+/*
+-- Usage: replay <trace file> [paced]
+-- Runs against a state with only the standard libraries.  Hooks saved from Do results are saved again from the replayed Do, but
+	embedders with registered functions should use ScriptTraceReplay directly.
+-- Prints a JSON report with latency percentiles in nanoseconds for the recording and the replay.
+*/
+
+static void PrintLatency(char const *Name, ScriptTraceReplay::Latency const &Data)
+{
+	std::cout << ", \"" << Name << "\": {\"count\": " << Data.Count << ", \"p50\": " << Data.Median << ", \"p90\": " << Data.Percentile90 <<
+		", \"p99\": " << Data.Percentile99 << ", \"p999\": " << Data.Percentile999 << ", \"max\": " << Data.Maximum << "}";
+}
+
+int main(int ArgumentCount, char **Arguments)
+{
+	if ((ArgumentCount < 2) || (ArgumentCount > 3) || ((ArgumentCount == 3) && (String(Arguments[2]) != "paced")))
+	{
+		std::cerr << "Usage: " << Arguments[0] << " <trace file> [paced]" << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		ScriptTraceReplay Trace(Arguments[1]);
+		Script State;
+		ScriptTraceReplay::Report Report = Trace.Run(State, ArgumentCount == 3);
+
+		std::cout << "{\"events\": " << Report.Events << ", \"nested\": " << Report.Nested << ", \"failures\": " << Report.Failures <<
+			", \"mismatches\": " << Report.Mismatches << ", \"seconds\": " << Report.Seconds;
+		PrintLatency("recorded_do", Report.RecordedDo);
+		PrintLatency("recorded_hooks", Report.RecordedHooks);
+		PrintLatency("replayed_do", Report.ReplayedDo);
+		PrintLatency("replayed_hooks", Report.ReplayedHooks);
+		std::cout << "}" << std::endl;
+	}
+	catch (Error::System &Failure)
+	{
+		std::cerr << Failure.Explanation << std::endl;
+		return 1;
+	}
+	catch (Error::Input &Failure)
+	{
+		std::cerr << Failure.Explanation << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -2,6 +2,11 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <system_error>
+#include <thread>
 
 String ScriptDataBuilder::Escape(String const &Input)
 {
@@ -156,6 +161,68 @@ ScriptDataBuilder &ScriptDataBuilder::CustomValue(String const &Data)
 	return *this;
 }
 
+ScriptDataBuilder &ScriptDataBuilder::Fork(std::vector<BranchFunction> const &Branches, unsigned int ThreadCount)
+{
+	assert(!AfterKey);
+
+	struct BranchResult
+	{
+		MemoryStream Buffer;
+		bool Empty;
+		std::exception_ptr Failure;
+		BranchResult(void) : Empty(true) {}
+	};
+	std::vector<std::unique_ptr<BranchResult> > Results;
+	for (unsigned int Index = 0; Index < Branches.size(); Index++)
+		Results.emplace_back(new BranchResult);
+
+	// Each branch starts at the current indentation as the first element at its level, so it doesn't emit a leading separator
+	std::atomic<unsigned int> NextBranch(0);
+	unsigned int const BranchIndentation = Indentation;
+	auto Work = [&](void)
+	{
+		for (unsigned int Index = NextBranch++; Index < Branches.size(); Index = NextBranch++)
+		{
+			BranchResult &Result = *Results[Index];
+			try
+			{
+				ScriptDataBuilder Branch(Result.Buffer, BranchIndentation);
+				Branches[Index](Branch);
+				assert(Branch.Indentation == BranchIndentation);
+				assert(!Branch.AfterKey);
+				Result.Empty = Branch.FirstAtLevel;
+			}
+			catch (...) { Result.Failure = std::current_exception(); }
+		}
+	};
+
+	if (ThreadCount == 0) ThreadCount = std::thread::hardware_concurrency();
+	if (ThreadCount > Branches.size()) ThreadCount = Branches.size();
+	std::vector<std::thread> Workers;
+	Workers.reserve(ThreadCount);
+	for (unsigned int Worker = 1; Worker < ThreadCount; Worker++)
+	{
+		// If a thread can't be started, the ones already running and this thread take the remaining branches
+		try { Workers.emplace_back(Work); }
+		catch (std::system_error const &) { break; }
+	}
+	Work();
+	for (auto &Worker : Workers) Worker.join();
+
+	for (auto &Result : Results)
+		if (Result->Failure) std::rethrow_exception(Result->Failure);
+
+	// Stitch the buffers, adding the separators the serial path would have written between elements
+	for (auto &Result : Results)
+	{
+		if (Result->Empty) continue;
+		if (!FirstAtLevel) Output << ",\n";
+		Output << (String)Result->Buffer;
+		FirstAtLevel = false;
+	}
+	return *this;
+}
+
 OutputStream &ScriptDataBuilder::GetOutput(void)
 {
 	return Output;
@@ -6,6 +6,9 @@
 #include "../ren-general/vector.h"
 #include "../ren-general/color.h"
 
+#include <functional>
+#include <vector>
+
 class ScriptDataBuilder
 {
 	public:
@@ -26,6 +29,12 @@ class ScriptDataBuilder
 		ScriptDataBuilder &Value(Color const &Data);
 		ScriptDataBuilder &Function(std::list<String> const &Arguments, String const &Body);
 		ScriptDataBuilder &CustomValue(String const &Data);
+
+		// Parallel generation - each branch writes a run of sibling elements at the current level (keys and values, 
+		// in order) to its own buffer on a worker thread.  The buffers are stitched together in branch order, so the 
+		// output is identical to calling the branches serially on this builder.  Branches must close any tables they open.
+		typedef std::function<void(ScriptDataBuilder &Branch)> BranchFunction;
+		ScriptDataBuilder &Fork(std::vector<BranchFunction> const &Branches, unsigned int ThreadCount = 0);
 		
 		OutputStream &GetOutput(void);
 		
@@ -1,4 +1,6 @@
 #include "script.h"
+#include "scripthookcache.h"
+#include "scripttrace.h"
 
 #include "../ren-general/string.h"
 #include "../ren-general/inputoutput.h"
@@ -6,16 +8,83 @@
 // System libraries/headers
 #include <iostream>
 #include <cassert>
+#include <new>
+
+// Data kept with the state in a registry slot, so every Script wrapping it (including the ones passed to registered functions) sees it
+struct ScriptStateData
+{
+	std::map<String, std::shared_ptr<ScriptHookCache> > HookCaches;
+	std::shared_ptr<ScriptTraceRecorder> Recorder;
+};
+
+namespace
+{
+	char ProxyMetatableKey;
+	char StateDataKey;
+	char StateDataMetatableKey;
+
+	int CollectStateData(lua_State *State)
+	{
+		((ScriptStateData *)lua_touserdata(State, 1))->~ScriptStateData();
+		return 0;
+	}
+
+	// Coroutines have their own lua_State but share the main thread's registry
+	lua_State *GetMainThread(lua_State *State)
+	{
+		lua_rawgeti(State, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+		lua_State *Out = lua_tothread(State, -1);
+		lua_pop(State, 1);
+		return Out;
+	}
+
+	// Runs an accessor, turning exceptions into Lua errors like PushFunction does
+	template <typename BodyType> int CallProxyAccessor(lua_State *State, BodyType const &Body)
+	{
+		String Message;
+		try { return Body(); }
+		catch (Error::System &Failure) { Message = "Encountered an error interacting with the system: " + Failure.Explanation; }
+		catch (Error::Input &Failure) { Message = Failure.Explanation; }
+		lua_pushstring(State, Message.c_str());
+		return lua_error(State);
+	}
+}
 
 String Script::UniqueIndex(void *Address, const String &Suffix)
 	{ return MemoryStream() << (long unsigned int)Address << "_" << Suffix; }
 
-Script::Script(void) : Instance(luaL_newstate()), Owner(true) 
+String Script::DescribeKey(lua_State *State, int Position)
+{
+	switch (lua_type(State, Position))
+	{
+		case LUA_TSTRING: return "." + String(lua_tostring(State, Position));
+		case LUA_TNUMBER: return "[" + AsString(lua_tonumber(State, Position)) + "]";
+		case LUA_TLIGHTUSERDATA: return "[" + AsString((long unsigned int)lua_touserdata(State, Position)) + "]";
+		default: return "[" + String(lua_typename(State, lua_type(State, Position))) + "]";
+	}
+}
+
+void *Script::CheckUserdata(lua_State *State, int Position, void const *Key, char const *Message)
+{
+	// Metamethods can be reached directly through pairs or getmetatable, so make sure this is really the expected userdata
+	void *Data = lua_touserdata(State, Position);
+	bool Valid = false;
+	if (Data && lua_getmetatable(State, Position))
+	{
+		lua_rawgetp(State, LUA_REGISTRYINDEX, Key);
+		Valid = lua_rawequal(State, -1, -2);
+		lua_pop(State, 2);
+	}
+	if (!Valid) luaL_argerror(State, Position, Message);
+	return Data;
+}
+
+Script::Script(void) : Instance(luaL_newstate()), Owner(true), StateData(nullptr)
 {
 	luaL_openlibs(Instance);
 }
 
-Script::Script(lua_State *FromInstance) : Instance(FromInstance), Owner(false) {}
+Script::Script(lua_State *FromInstance) : Instance(FromInstance), Owner(false), StateData(nullptr) {}
 
 Script::~Script(void)
 {
@@ -34,70 +103,66 @@ String Script::DumpStack(unsigned int Depth)
 #endif
 	MemoryStream Out;
 
-	std::function<void(unsigned int, String)> DumpTable = [&](unsigned int CurrentDepth, String IndentPadding)
+	for (unsigned int Position = 1; Position <= Height(); ++Position)
 	{
-#ifndef NDEBUG
-		unsigned int const TableInitialHeight = Height();
-#endif
-		Iterate([&](Script &)
+		Out << Position << ": " << lua_typename(Instance, lua_type(Instance, Position)) << "\n";
+		if (lua_istable(Instance, Position))
 		{
+			Duplicate(Position);
+			DumpTable(Out, 0, Depth, "\t");
+			Pop();
+		}
+	}
 #ifndef NDEBUG
-			unsigned int const IterateInitialHeight = Height();
+	assert(Height() == InitialHeight);
 #endif
-			Duplicate(-2);
-			String Key;
-			if (IsString()) Key = GetString();
-			else if (IsNumber()) Key = AsString(GetFloat());
-			else { Key = GetType(); Pop(); }
-
-			String Value;
-			if (IsString()) Value = GetString();
-			else if (IsNumber()) Value = AsString(GetFloat());
-			else 
-			{ 
-				Value = GetType();
-
-				Out << IndentPadding << Key << ": " << Value << "\n";
 
-				if (IsTable() && (CurrentDepth < Depth))
-					DumpTable(CurrentDepth + 1, IndentPadding + "\t");
-
-				Pop();
-#ifndef NDEBUG
-				assert(Height() == IterateInitialHeight - 1);
-#endif
-				return true;
-			}
+	return Out;
+}
 
-			Out << IndentPadding << Key << ": " << Value << "\n";
-#ifndef NDEBUG
-			assert(Height() == IterateInitialHeight - 1);
-#endif
-			return true;
-		});
+void Script::DumpTable(OutputStream &Out, unsigned int CurrentDepth, unsigned int Depth, String const &IndentPadding)
+{
 #ifndef NDEBUG
-		assert(Height() == TableInitialHeight);
+	unsigned int const InitialHeight = Height();
 #endif
-	};
-
-	for (unsigned int Position = 1; Position <= Height(); ++Position)
+	ForEachPair([&](ScriptValue const &Key, ScriptValue const &Value)
 	{
-		Out << Position << ": " << lua_typename(Instance, lua_type(Instance, Position)) << "\n";
-		if (lua_istable(Instance, Position))
+		Out << IndentPadding << (Key.IsString() ? Key.GetString() : Key.GetType()) << ": " << 
+			(Value.IsString() ? Value.GetString() : Value.GetType()) << "\n";
+		if (Value.IsTable() && (CurrentDepth < Depth))
 		{
-			Duplicate(Position);
-			DumpTable(0, "\t");
+			Duplicate(Value.GetPosition());
+			DumpTable(Out, CurrentDepth + 1, Depth, IndentPadding + "\t");
 			Pop();
 		}
-	}
+		return true;
+	});
 #ifndef NDEBUG
 	assert(Height() == InitialHeight);
 #endif
-
-	return Out;
 }
 
 bool Script::Do(const String &ScriptName, bool ShowErrors)
+{
+	ScriptStateData *Data = FindStateData();
+	if (!Data || !Data->Recorder) return RunFile(ScriptName, ShowErrors);
+	std::shared_ptr<ScriptTraceRecorder> Recorder = Data->Recorder; // Held in case recording stops during the call
+	ScriptTraceRecorder::PendingCall Call = Recorder->BeginDo();
+	bool Succeeded = RunFile(ScriptName, ShowErrors);
+	Recorder->EndDo(Call, ScriptName, ShowErrors, Succeeded);
+	return Succeeded;
+}
+
+void Script::StartRecording(const String &Filename)
+	{ GetStateData().Recorder = std::make_shared<ScriptTraceRecorder>(Filename); }
+
+void Script::StopRecording(void)
+{
+	ScriptStateData *Data = FindStateData();
+	if (Data) Data->Recorder.reset();
+}
+
+bool Script::RunFile(const String &ScriptName, bool ShowErrors)
 {
 	assert(Height() == 0);
 	if (ShowErrors)
@@ -292,7 +357,11 @@ Color Script::GetColor(void)
 }
 
 void Script::SaveGlobal(const String &GlobalName)
-	{ lua_setglobal(Instance, GlobalName.c_str()); }
+{
+	ScriptStateData *Data = FindStateData();
+	if (Data && Data->Recorder) Data->Recorder->RecordSave(Instance, GlobalName, true);
+	lua_setglobal(Instance, GlobalName.c_str());
+}
 
 void Script::SaveInternal(const String &InternalName)
 {
@@ -300,6 +369,8 @@ void Script::SaveInternal(const String &InternalName)
 	unsigned int InitialHeight = Height();
 	assert(InitialHeight > 0);
 #endif
+	ScriptStateData *Data = FindStateData();
+	if (Data && Data->Recorder) Data->Recorder->RecordSave(Instance, InternalName, false);
 	lua_pushstring(Instance, InternalName.c_str());
 	Lift(-2);
 	lua_settable(Instance, LUA_REGISTRYINDEX);
@@ -308,6 +379,24 @@ void Script::SaveInternal(const String &InternalName)
 #endif
 }
 
+ScriptReference Script::SaveReference(void)
+{
+	assert(Height() > 0);
+	return ScriptReference(GetMainThread(Instance), luaL_ref(Instance, LUA_REGISTRYINDEX));
+}
+
+void Script::SaveSlot(void const *Key)
+{
+	assert(Height() > 0);
+	lua_rawsetp(Instance, LUA_REGISTRYINDEX, Key);
+}
+
+void Script::ClearSlot(void const *Key)
+{
+	lua_pushnil(Instance);
+	lua_rawsetp(Instance, LUA_REGISTRYINDEX, Key);
+}
+
 void Script::PushNil(void)
 	{ lua_pushnil(Instance); }
 
@@ -363,12 +452,58 @@ void Script::PushFunction(Function NewFunction)
 void Script::PushTable(void)
 	{ lua_newtable(Instance); }
 
+void Script::PushProxy(ScriptProxyAccessors const &Accessors)
+{
+#ifndef NDEBUG
+	unsigned int InitialHeight = Height();
+#endif
+	new (lua_newuserdata(Instance, sizeof(ScriptProxyAccessors))) ScriptProxyAccessors(Accessors);
+
+	static luaL_Reg const Methods[] =
+	{
+		{"__index", HandleProxyIndex},
+		{"__newindex", HandleProxyNewIndex},
+		{"__len", HandleProxyLength},
+		{"__pairs", HandleProxyPairs},
+		{"__gc", HandleProxyCollect},
+		{nullptr, nullptr}
+	};
+	PushMetatable(&ProxyMetatableKey, Methods, "ScriptProxy");
+	lua_setmetatable(Instance, -2);
+#ifndef NDEBUG
+	assert(Height() == InitialHeight + 1);
+#endif
+}
+
+void Script::PushMetatable(void const *Key, luaL_Reg const *Methods, char const *Name)
+{
+	PushSlot(Key);
+	if (!IsNil()) return;
+	Pop();
+	lua_newtable(Instance);
+	luaL_setfuncs(Instance, Methods, 0);
+	lua_pushstring(Instance, Name);
+	lua_setfield(Instance, -2, "__metatable");
+	Duplicate(-1);
+	SaveSlot(Key);
+}
+
 void Script::PushGlobal(const String &GlobalName)
 	{ lua_getglobal(Instance, GlobalName.c_str()); }
 		
 void Script::PushInternal(const String &InternalName)
 	{ lua_getfield(Instance, LUA_REGISTRYINDEX, InternalName.c_str()); }
 		
+void Script::PushReference(ScriptReference const &Reference)
+{
+	assert(Reference.IsValid());
+	assert(Reference.Instance == GetMainThread(Instance));
+	lua_rawgeti(Instance, LUA_REGISTRYINDEX, Reference.Index);
+}
+
+void Script::PushSlot(void const *Key)
+	{ lua_rawgetp(Instance, LUA_REGISTRYINDEX, Key); }
+
 bool Script::IsEmpty(void)
 {
 	assert(IsTable());
@@ -478,27 +613,68 @@ void Script::PutElement(int Index)
 
 void Script::CallHook(const String &HookName, int Arguments)
 {
-	// Get the debug function, for failed calls
-	lua_getglobal(Instance, "debug");
-	lua_getfield(Instance, -1, "traceback");
-	lua_remove(Instance, -2);
+	ScriptStateData *Data = FindStateData();
+	if (!Data || !Data->Recorder)
+	{
+		CallNamedHook(HookName, Arguments);
+		return;
+	}
+	std::shared_ptr<ScriptTraceRecorder> Recorder = Data->Recorder;
+	int const FirstResult = Height() - Arguments + 1;
+	ScriptTraceRecorder::PendingCall Call = Recorder->BeginHook(Instance, Arguments);
+	bool Succeeded = CallNamedHook(HookName, Arguments);
+	Recorder->EndHook(Call, HookName, Instance, FirstResult, Succeeded);
+}
+
+bool Script::CallNamedHook(const String &HookName, int Arguments)
+{
+	// Check for memoized results
+	std::shared_ptr<ScriptHookCache> Cache; // Held in case the hook memoizes itself again
+	ScriptHookCache::Key CacheKey;
+	ScriptStateData *Data = FindStateData();
+	if (Data && !Data->HookCaches.empty())
+	{
+		auto Found = Data->HookCaches.find(HookName);
+		if (Found != Data->HookCaches.end())
+		{
+			ScriptHookCache::LookupResult Result = Found->second->Find(Instance, Arguments, CacheKey);
+			if (Result == ScriptHookCache::Hit) return true;
+			if (Result == ScriptHookCache::Miss) Cache = Found->second;
+		}
+	}
+	int const FirstResult = Height() - Arguments + 1;
 
 	// Grab the hook
 	lua_pushstring(Instance, HookName.c_str());
 	lua_gettable(Instance, LUA_REGISTRYINDEX);
+	bool Succeeded = CallPushedHook(HookName.c_str(), Arguments);
+	if (Succeeded && Cache)
+		Cache->Store(Instance, FirstResult, std::move(CacheKey));
+	return Succeeded;
+}
 
-	// Move all the arguments to the correct stack position
-	for (int UnmovedArguments = Arguments; UnmovedArguments > 0; UnmovedArguments--)
-	{
-		lua_pushvalue(Instance, -2 - Arguments);
-		lua_remove(Instance, -3 - Arguments);
-	}
+void Script::CallHook(ScriptReference const &Hook, int Arguments)
+{
+	PushReference(Hook);
+	CallPushedHook("(by reference)", Arguments);
+}
+
+bool Script::CallPushedHook(char const *HookName, int Arguments)
+{
+	// Get the debug function, for failed calls
+	lua_getglobal(Instance, "debug");
+	lua_getfield(Instance, -1, "traceback");
+	lua_remove(Instance, -2);
+
+	// Move the debug function and hook below the arguments
+	lua_insert(Instance, -2 - Arguments);
+	lua_insert(Instance, -1 - Arguments);
 
 	// Get the dbug function position, to remove it afterwards
 	int DebugPosition = lua_gettop(Instance) - Arguments - 1;
 
 	// Call the hook
-	int Result = lua_pcall(Instance, Arguments, LUA_MULTRET, -2 - Arguments);
+	int Result = lua_pcall(Instance, Arguments, LUA_MULTRET, DebugPosition);
 
 	// Check for errors, remove any returned values
 	if (Result != 0)
@@ -509,6 +685,61 @@ void Script::CallHook(const String &HookName, int Arguments)
 
 	assert(lua_isfunction(Instance, DebugPosition));
 	lua_remove(Instance, DebugPosition);
+	return Result == 0;
+}
+
+void Script::MemoizeHook(const String &HookName, unsigned int Capacity)
+{
+	if (Capacity == 0) throw Error::Input("Memoized hook " + HookName + " needs room for at least one result.");
+	GetStateData().HookCaches[HookName] = std::make_shared<ScriptHookCache>(Capacity);
+}
+
+void Script::InvalidateHook(const String &HookName)
+{
+	ScriptStateData *Data = FindStateData();
+	if (!Data) return;
+	auto Found = Data->HookCaches.find(HookName);
+	if (Found != Data->HookCaches.end()) Found->second->Clear();
+}
+
+void Script::InvalidateHooks(void)
+{
+	ScriptStateData *Data = FindStateData();
+	if (!Data) return;
+	for (auto &Cache : Data->HookCaches) Cache.second->Clear();
+}
+
+ScriptHookStatistics Script::GetHookStatistics(const String &HookName)
+{
+	ScriptStateData *Data = FindStateData();
+	if (!Data) return ScriptHookStatistics();
+	auto Found = Data->HookCaches.find(HookName);
+	if (Found == Data->HookCaches.end()) return ScriptHookStatistics();
+	return Found->second->GetStatistics();
+}
+
+ScriptStateData *Script::FindStateData(void)
+{
+	if (StateData) return StateData;
+	PushSlot(&StateDataKey);
+	StateData = (ScriptStateData *)lua_touserdata(Instance, -1);
+	Pop();
+	return StateData;
+}
+
+ScriptStateData &Script::GetStateData(void)
+{
+	if (FindStateData()) return *StateData;
+	StateData = new (lua_newuserdata(Instance, sizeof(ScriptStateData))) ScriptStateData;
+	static luaL_Reg const Methods[] =
+	{
+		{"__gc", CollectStateData},
+		{nullptr, nullptr}
+	};
+	PushMetatable(&StateDataMetatableKey, Methods, "ScriptStateData");
+	lua_setmetatable(Instance, -2);
+	SaveSlot(&StateDataKey);
+	return *StateData;
 }
 
 void Script::PushPointer(void *Pointer)
@@ -524,6 +755,65 @@ void *Script::GetPointer(void)
 	return Out;
 }
 
+ScriptProxyAccessors &Script::GetProxy(lua_State *State)
+{
+	ScriptProxyAccessors &Proxy = *(ScriptProxyAccessors *)CheckUserdata(State, 1, &ProxyMetatableKey, "proxy expected");
+	if (Proxy.Attached && !*Proxy.Attached) luaL_error(State, "attempted to use detached data");
+	return Proxy;
+}
+
+int Script::HandleProxyIndex(lua_State *State)
+{
+	ScriptProxyAccessors &Proxy = GetProxy(State);
+	if (!Proxy.Get) return luaL_error(State, "attempted to read write-only data");
+	lua_settop(State, 2);
+	return CallProxyAccessor(State, [&](void) { Script Target(State); Proxy.Get(Target); return 1; });
+}
+
+int Script::HandleProxyNewIndex(lua_State *State)
+{
+	ScriptProxyAccessors &Proxy = GetProxy(State);
+	if (!Proxy.Set) return luaL_error(State, "attempted to modify read-only data");
+	lua_settop(State, 3);
+	return CallProxyAccessor(State, [&](void) { Script Target(State); Proxy.Set(Target); return 0; });
+}
+
+int Script::HandleProxyLength(lua_State *State)
+{
+	ScriptProxyAccessors &Proxy = GetProxy(State);
+	if (!Proxy.Length) return luaL_error(State, "attempted to get the length of unsized data");
+	return CallProxyAccessor(State, [&](void) { lua_pushinteger(State, Proxy.Length()); return 1; });
+}
+
+int Script::HandleProxyPairs(lua_State *State)
+{
+	ScriptProxyAccessors &Proxy = GetProxy(State);
+	if (!Proxy.Next) return luaL_error(State, "attempted to iterate unordered data");
+	lua_pushcfunction(State, HandleProxyNext);
+	lua_pushvalue(State, 1);
+	lua_pushnil(State);
+	return 3;
+}
+
+int Script::HandleProxyNext(lua_State *State)
+{
+	ScriptProxyAccessors &Proxy = GetProxy(State);
+	lua_settop(State, 2);
+	return CallProxyAccessor(State, [&](void)
+	{
+		Script Target(State);
+		if (Proxy.Next(Target)) return 2;
+		lua_pushnil(State);
+		return 1;
+	});
+}
+
+int Script::HandleProxyCollect(lua_State *State)
+{
+	((ScriptProxyAccessors *)lua_touserdata(State, 1))->~ScriptProxyAccessors();
+	return 0;
+}
+
 int Script::HandleRegisteredFunction(lua_State *State)
 {
 	auto &TargetFunction = *(std::function<int(Script State)> *)lua_touserdata(State, lua_upvalueindex(1));
@@ -21,6 +21,9 @@ extern "C"
 #endif
 
 #include <functional>
+#include <cassert>
+#include <map>
+#include <memory>
 
 #include "../ren-general/string.h"
 #include "../ren-general/auxinclude.h"
@@ -28,11 +31,112 @@ extern "C"
 #include "../ren-general/color.h"
 #include "../ren-general/lifetime.h"
 
+class OutputStream;
+class Script;
+struct ScriptStateData;
+
+struct ScriptHookStatistics
+{
+	unsigned long Hits, Misses, Evictions, Bypasses; // Bypasses are calls with arguments that can't be cached
+};
+
+// A value on the stack, left in place while it's examined
+class ScriptValue
+{
+	public:
+		ScriptValue(lua_State *Instance, int Position) : Instance(Instance), Position(Position) {}
+
+		int GetPosition(void) const { return Position; }
+
+		bool IsNil(void) const { return lua_isnil(Instance, Position); }
+		bool IsString(void) const { return lua_isstring(Instance, Position); }
+		bool IsBoolean(void) const { return lua_isboolean(Instance, Position); }
+		bool IsNumber(void) const { return lua_isnumber(Instance, Position); }
+		bool IsTable(void) const { return lua_istable(Instance, Position); }
+		bool IsFunction(void) const { return lua_isfunction(Instance, Position); }
+		String GetType(void) const { return lua_typename(Instance, lua_type(Instance, Position)); }
+
+		String GetString(void) const
+		{
+			assert(IsString());
+			if (lua_type(Instance, Position) == LUA_TSTRING)
+			{
+				size_t Length;
+				char const *Data = lua_tolstring(Instance, Position, &Length);
+				return String(Data, Length);
+			}
+			// Convert a copy, converting in place confuses lua_next
+			lua_pushvalue(Instance, Position);
+			String Out = lua_tostring(Instance, -1);
+			lua_pop(Instance, 1);
+			return Out;
+		}
+		int GetInteger(void) const { assert(IsNumber()); return lua_tointeger(Instance, Position); }
+		int GetIndex(void) const { assert(IsNumber()); return lua_tointeger(Instance, Position) - 1; }
+		float GetFloat(void) const { assert(IsNumber()); return lua_tonumber(Instance, Position); }
+		bool GetBoolean(void) const { assert(IsBoolean()); return lua_toboolean(Instance, Position); }
+
+	private:
+		lua_State *Instance;
+		int Position;
+};
+
+// Integer registry reference (luaL_ref), released when destroyed or when Release is called
+class ScriptReference
+{
+	public:
+		ScriptReference(void) : Instance(nullptr), Index(LUA_NOREF) {}
+		ScriptReference(ScriptReference &&Other) noexcept : Instance(Other.Instance), Index(Other.Index) { Other.Index = LUA_NOREF; }
+		ScriptReference(ScriptReference const &Other) = delete;
+		ScriptReference &operator =(ScriptReference &&Other) noexcept
+		{
+			if (&Other == this) return *this;
+			Release();
+			Instance = Other.Instance;
+			Index = Other.Index;
+			Other.Index = LUA_NOREF;
+			return *this;
+		}
+		ScriptReference &operator =(ScriptReference const &Other) = delete;
+		~ScriptReference(void) { Release(); }
+
+		bool IsValid(void) const { return Index != LUA_NOREF; }
+		int GetIndex(void) const { return Index; }
+
+		void Release(void)
+		{
+			if (Index == LUA_NOREF) return;
+			luaL_unref(Instance, LUA_REGISTRYINDEX, Index);
+			Index = LUA_NOREF;
+		}
+
+	private:
+		friend class Script;
+		ScriptReference(lua_State *Instance, int Index) : Instance(Instance), Index(Index) {}
+
+		lua_State *Instance; // Main thread, coroutines share its registry
+		int Index;
+};
+
+// Callbacks exposing C++ data as userdata (Script::PushProxy), see scriptproxy.h for containers
+struct ScriptProxyAccessors
+{
+	std::function<void(Script &State)> Get; // Replaces the key on the top of the stack with its value or nil
+	std::function<void(Script &State)> Set; // Consumes a key and value (value on top), leave empty for read-only data
+	std::function<unsigned int(void)> Length;
+	std::function<bool(Script &State)> Next; // Replaces the key on the top (nil to start) with the next key and value, or pops it and returns false
+	std::shared_ptr<bool const> Attached; // Optional, once it's false the accessors aren't called and scripts get an error instead
+};
+
 class Script
 {
 	public:
-		// Unique index utility - creates an index from an address
+		// Unique index utility - creates an index from an address.  Prefer SaveSlot/PushSlot, which skip the formatting and string hashing.
 		static String UniqueIndex(void *Address, const String &Suffix);
+		// Describes a table key for paths in messages, like ".Name" or "[3]"
+		static String DescribeKey(lua_State *State, int Position);
+		// Returns the userdata at Position if its metatable is the one pushed by PushMetatable with Key, otherwise raises a Lua argument error with Message
+		static void *CheckUserdata(lua_State *State, int Position, void const *Key, char const *Message);
 
 		Script(void);
 		Script(lua_State *FromInstance);
@@ -44,6 +148,10 @@ class Script
 		
 		// Code loading and execution
 		bool Do(const String &ScriptName, bool ShowErrors);
+
+		// Logs Do, CallHook (by name) and saves on any Script using the state to a binary trace file for ScriptTraceReplay, see scripttrace.h
+		void StartRecording(const String &Filename);
+		void StopRecording(void);
 		
 		// Stack information and manipulation
 		unsigned int Height(void);
@@ -84,6 +192,9 @@ class Script
 		
 		void SaveGlobal(const String &GlobalName);
 		void SaveInternal(const String &InternalName); // Stores a value in Lua registry
+		ScriptReference SaveReference(void); // Pops a value into the Lua registry, indexed by integer
+		void SaveSlot(void const *Key); // Pops a value into the Lua registry, indexed by address (per-object storage)
+		void ClearSlot(void const *Key);
 
 		// Information put functions
 		void PushNil(void);
@@ -98,9 +209,13 @@ class Script
 		void Error(const String &Message);
 
 		void PushTable(void);
+		void PushProxy(ScriptProxyAccessors const &Accessors); // Userdata that calls the accessors on demand when indexed, assigned, measured or iterated
+		void PushMetatable(void const *Key, luaL_Reg const *Methods, char const *Name); // Userdata metatable, created in the slot for Key on first use.  Name protects it from getmetatable.
 
 		void PushGlobal(const String &GlobalName);
 		void PushInternal(const String &ValueName); // Pushes a value from Lua registry
+		void PushReference(ScriptReference const &Reference);
+		void PushSlot(void const *Key);
 
 		// Table methods
 		bool IsEmpty(void);
@@ -113,11 +228,27 @@ class Script
 
 		void Iterate(std::function<bool(Script &State)> Processor);
 
+		// Inlinable iteration.  Each leaves the table on the stack.  Processors return false to stop early.
+		// Processor(Script &State) - same as Iterate, key and value on the stack, processor consumes the value
+		template <typename ProcessorType> void ForEach(ProcessorType &&Processor);
+		// Processor(Script &State, int Index) - walks 1..#t with raw access, Index is less one like GetIndex, processor consumes the value
+		template <typename ProcessorType> void ForEachIndex(ProcessorType &&Processor);
+		// Processor(ScriptValue const &Key, ScriptValue const &Value) - key and value are left in place, processor must leave the stack as it found it
+		template <typename ProcessorType> void ForEachPair(ProcessorType &&Processor);
+
 		void PutElement(const String &Index);
 		void PutElement(int Index);
 
 		// Lua function methods
 		void CallHook(const String &HookName, int Arguments = 0);
+		void CallHook(ScriptReference const &Hook, int Arguments = 0);
+
+		// Hook memoization - for hooks that are pure functions of nil/boolean/number/string arguments.  Applies to CallHook by name on any
+		// Script using the state, including the ones passed to registered functions.
+		void MemoizeHook(const String &HookName, unsigned int Capacity); // Throws Error::Input if Capacity is 0
+		void InvalidateHook(const String &HookName); // Drops cached results, keeps memoizing
+		void InvalidateHooks(void); // Drops all cached results, e.g. after reloading scripts
+		ScriptHookStatistics GetHookStatistics(const String &HookName);
 
 		// Hacky stuffs
 		void PushPointer(void *Pointer);
@@ -125,10 +256,73 @@ class Script
 
 	private:
 		static int HandleRegisteredFunction(lua_State *State);
+		static ScriptProxyAccessors &GetProxy(lua_State *State);
+		static int HandleProxyIndex(lua_State *State);
+		static int HandleProxyNewIndex(lua_State *State);
+		static int HandleProxyLength(lua_State *State);
+		static int HandleProxyPairs(lua_State *State);
+		static int HandleProxyNext(lua_State *State);
+		static int HandleProxyCollect(lua_State *State);
+		bool RunFile(const String &ScriptName, bool ShowErrors);
+		bool CallNamedHook(const String &HookName, int Arguments);
+		bool CallPushedHook(char const *HookName, int Arguments);
+		ScriptStateData *FindStateData(void);
+		ScriptStateData &GetStateData(void);
+		void DumpTable(OutputStream &Out, unsigned int CurrentDepth, unsigned int Depth, String const &IndentPadding);
 
 		lua_State *Instance;
 		bool Owner;
 		std::list<std::function<int(Script State)> > FunctionStorage;
+		ScriptStateData *StateData; // Shared by every Script on the state, found on first use
 };
 
+template <typename ProcessorType> void Script::ForEach(ProcessorType &&Processor)
+{
+	assert(IsTable());
+	lua_pushnil(Instance);
+	while (lua_next(Instance, -2))
+	{
+#ifndef NDEBUG
+		unsigned int InitialHeight = Height(); // Table + key + value
+#endif
+		bool Continue = Processor(*this); // Consumes value
+#ifndef NDEBUG
+		assert(Height() == InitialHeight - 1); // Table + key
+#endif
+		if (!Continue)
+		{
+			Pop(); // Pop the key
+			break;
+		}
+	}
+}
+
+template <typename ProcessorType> void Script::ForEachIndex(ProcessorType &&Processor)
+{
+	assert(IsTable());
+	int const Table = lua_gettop(Instance);
+	int const Count = lua_rawlen(Instance, Table);
+	for (int Index = 1; Index <= Count; Index++)
+	{
+		lua_rawgeti(Instance, Table, Index);
+		bool Continue = Processor(*this, Index - 1); // Consumes value
+		assert(lua_gettop(Instance) == Table);
+		if (!Continue) break;
+	}
+}
+
+template <typename ProcessorType> void Script::ForEachPair(ProcessorType &&Processor)
+{
+	assert(IsTable());
+	int const Table = lua_gettop(Instance);
+	lua_pushnil(Instance);
+	while (lua_next(Instance, Table))
+	{
+		bool Continue = Processor(ScriptValue(Instance, Table + 1), ScriptValue(Instance, Table + 2));
+		assert(lua_gettop(Instance) == Table + 2);
+		lua_pop(Instance, Continue ? 1 : 2);
+		if (!Continue) break;
+	}
+}
+
 #endif
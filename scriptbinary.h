@@ -0,0 +1,84 @@
+#ifndef scriptbinary_h
+#define scriptbinary_h
+
+// Compact binary encoding helpers for script images and traces
+
+/*
+-- Values are written in host byte order, images are not portable between architectures.
+-- Readers throw Error::Input if the data runs out.
+*/
+
+#include "../ren-general/string.h"
+#include "../ren-general/auxinclude.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+class ScriptBinaryWriter
+{
+	public:
+		void WriteByte(uint8_t Data) { Output.push_back((char)Data); }
+		void WriteInteger(uint32_t Data) { WriteRaw(&Data, sizeof(Data)); }
+		void WriteLong(uint64_t Data) { WriteRaw(&Data, sizeof(Data)); }
+		void WriteNumber(double Data) { WriteRaw(&Data, sizeof(Data)); }
+		void WriteString(char const *Data, size_t Length) { WriteInteger(Length); Output.append(Data, Length); }
+		void WriteString(String const &Data) { WriteString(Data.c_str(), Data.size()); }
+		void WriteRaw(void const *Data, size_t Length) { Output.append((char const *)Data, Length); }
+
+		String const &GetData(void) const { return Output; }
+		void Clear(void) { Output.clear(); }
+
+	private:
+		String Output;
+};
+
+class ScriptBinaryReader
+{
+	public:
+		ScriptBinaryReader(String const &Input) : Input(Input), Position(0) {}
+
+		bool AtEnd(void) const { return Position >= Input.size(); }
+		size_t Remaining(void) const { return Input.size() - Position; }
+		void Skip(size_t Length) { Require(Length); Position += Length; }
+		uint8_t ReadByte(void) { uint8_t Out; ReadRaw(&Out, sizeof(Out)); return Out; }
+		uint8_t PeekByte(void) const { Require(1); return (uint8_t)Input[Position]; }
+		uint32_t ReadInteger(void) { uint32_t Out; ReadRaw(&Out, sizeof(Out)); return Out; }
+		uint64_t ReadLong(void) { uint64_t Out; ReadRaw(&Out, sizeof(Out)); return Out; }
+		double ReadNumber(void) { double Out; ReadRaw(&Out, sizeof(Out)); return Out; }
+		String ReadString(void)
+		{
+			uint32_t Length = ReadInteger();
+			Require(Length);
+			String Out = Input.substr(Position, Length);
+			Position += Length;
+			return Out;
+		}
+		void ReadRaw(void *Out, size_t Length)
+		{
+			Require(Length);
+			memcpy(Out, Input.data() + Position, Length);
+			Position += Length;
+		}
+
+	private:
+		void Require(size_t Length) const
+			{ if (Input.size() - Position < Length) throw Error::Input("Binary data is truncated."); }
+
+		String const &Input;
+		size_t Position;
+};
+
+// Reads a whole file for a reader.  Kind names the file in messages (e.g. "trace").  Throws Error::System if it can't be opened or read.
+inline String ScriptBinaryReadFile(String const &Filename, String const &Kind)
+{
+	std::ifstream File(Filename.c_str(), std::ios::in | std::ios::binary);
+	if (!File) throw Error::System("Couldn't open " + Kind + " file " + Filename + ".");
+	std::stringstream Contents;
+	Contents << File.rdbuf();
+	if (File.bad()) throw Error::System("Couldn't read " + Kind + " file " + Filename + ".");
+	return Contents.str();
+}
+
+#endif
@@ -0,0 +1,138 @@
+#include "scripthookcache.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+ScriptHookCache::ScriptHookCache(unsigned int Capacity) : Capacity(Capacity), Statistics() { assert(Capacity > 0); }
+
+ScriptHookCache::LookupResult ScriptHookCache::Find(lua_State *State, int Arguments, Key &Out)
+{
+	Out.resize(Arguments);
+	int const FirstArgument = lua_gettop(State) - Arguments + 1;
+	for (int Argument = 0; Argument < Arguments; Argument++)
+		if (!Read(State, FirstArgument + Argument, Out[Argument]))
+		{
+			Statistics.Bypasses++;
+			return Uncacheable;
+		}
+
+	auto Found = Index.find(Out);
+	if (Found == Index.end())
+	{
+		Statistics.Misses++;
+		return Miss;
+	}
+
+	Statistics.Hits++;
+	Entries.splice(Entries.begin(), Entries, Found->second);
+	lua_settop(State, FirstArgument - 1);
+	for (auto &Result : Found->second->second) Push(State, Result);
+	return Hit;
+}
+
+void ScriptHookCache::Store(lua_State *State, int FirstResult, Key &&Arguments)
+{
+	std::vector<Value> Results(lua_gettop(State) - FirstResult + 1);
+	for (unsigned int Result = 0; Result < Results.size(); Result++)
+		if (!Read(State, FirstResult + Result, Results[Result])) return;
+
+	// A reentrant call may have stored this already
+	auto Found = Index.find(Arguments);
+	if (Found != Index.end())
+	{
+		Found->second->second.swap(Results);
+		Entries.splice(Entries.begin(), Entries, Found->second);
+		return;
+	}
+
+	if (Entries.size() >= Capacity)
+	{
+		Index.erase(Entries.back().first);
+		Entries.pop_back();
+		Statistics.Evictions++;
+	}
+	Entries.push_front(std::make_pair(std::move(Arguments), std::move(Results)));
+	Index[Entries.front().first] = Entries.begin();
+}
+
+void ScriptHookCache::Clear(void)
+{
+	Index.clear();
+	Entries.clear();
+}
+
+ScriptHookStatistics const &ScriptHookCache::GetStatistics(void) const
+	{ return Statistics; }
+
+bool ScriptHookCache::Read(lua_State *State, int Position, Value &Out)
+{
+	Out.Type = lua_type(State, Position);
+	Out.IsInteger = false;
+	Out.Number = 0;
+	Out.Integer = 0;
+	Out.Text.clear();
+	switch (Out.Type)
+	{
+		case LUA_TNIL: return true;
+		case LUA_TBOOLEAN: Out.Number = lua_toboolean(State, Position); return true;
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(State, Position))
+			{
+				Out.IsInteger = true;
+				Out.Integer = lua_tointeger(State, Position);
+				return true;
+			}
+#endif
+			Out.Number = lua_tonumber(State, Position);
+			return Out.Number == Out.Number; // NaN never matches
+		case LUA_TSTRING:
+		{
+			size_t Length;
+			char const *Data = lua_tolstring(State, Position, &Length);
+			Out.Text.assign(Data, Length);
+			return true;
+		}
+		default: return false;
+	}
+}
+
+void ScriptHookCache::Push(lua_State *State, Value const &Data)
+{
+	switch (Data.Type)
+	{
+		case LUA_TNIL: lua_pushnil(State); break;
+		case LUA_TBOOLEAN: lua_pushboolean(State, Data.Number != 0); break;
+		case LUA_TNUMBER:
+			if (Data.IsInteger) lua_pushinteger(State, Data.Integer);
+			else lua_pushnumber(State, Data.Number);
+			break;
+		case LUA_TSTRING: lua_pushlstring(State, Data.Text.c_str(), Data.Text.size()); break;
+		default: assert(false); break;
+	}
+}
+
+size_t ScriptHookCache::KeyHash::operator ()(Key const &Data) const
+{
+	// FNV-1a
+	uint64_t Hash = 14695981039346656037ull;
+	auto Mix = [&Hash](void const *Bytes, size_t Length)
+	{
+		for (size_t Index = 0; Index < Length; Index++)
+		{
+			Hash ^= ((unsigned char const *)Bytes)[Index];
+			Hash *= 1099511628211ull;
+		}
+	};
+	for (auto &Argument : Data)
+	{
+		Mix(&Argument.Type, sizeof(Argument.Type));
+		Mix(&Argument.IsInteger, sizeof(Argument.IsInteger));
+		double Number = (Argument.Number == 0) ? 0 : Argument.Number; // -0 == 0
+		Mix(&Number, sizeof(Number));
+		Mix(&Argument.Integer, sizeof(Argument.Integer));
+		Mix(Argument.Text.data(), Argument.Text.size());
+	}
+	return Hash;
+}
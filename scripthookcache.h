@@ -0,0 +1,61 @@
+#ifndef scripthookcache_h
+#define scripthookcache_h
+
+// Bounded result cache for pure hooks, see Script::MemoizeHook
+
+/*
+-- Keyed on the hook's arguments, which must all be nil, booleans, numbers or strings.  Calls with other arguments bypass the cache.
+-- Results are only cached if they're all primitive too.
+-- The least recently used entry is evicted when the cache is full.
+*/
+
+#include "script.h"
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+class ScriptHookCache
+{
+	public:
+		struct Value
+		{
+			int Type;
+			bool IsInteger; // Lua 5.3+ integer subtype, kept in Integer rather than Number
+			double Number; // Also booleans
+			lua_Integer Integer;
+			String Text;
+			bool operator ==(Value const &Other) const
+			{
+				return (Type == Other.Type) && (IsInteger == Other.IsInteger) && (Number == Other.Number) &&
+					(Integer == Other.Integer) && (Text == Other.Text);
+			}
+		};
+		typedef std::vector<Value> Key;
+
+		enum LookupResult { Hit, Miss, Uncacheable };
+
+		ScriptHookCache(unsigned int Capacity);
+
+		// Arguments are on the top of the stack.  On a hit they're replaced with the cached results.  On a miss Out is the key to Store with.
+		LookupResult Find(lua_State *State, int Arguments, Key &Out);
+		// Caches the values from FirstResult to the top of the stack
+		void Store(lua_State *State, int FirstResult, Key &&Arguments);
+		void Clear(void);
+
+		ScriptHookStatistics const &GetStatistics(void) const;
+
+	private:
+		static bool Read(lua_State *State, int Position, Value &Out);
+		static void Push(lua_State *State, Value const &Data);
+
+		struct KeyHash { size_t operator ()(Key const &Data) const; };
+		typedef std::list<std::pair<Key, std::vector<Value> > > EntryList;
+
+		unsigned int const Capacity;
+		EntryList Entries; // Most recently used first
+		std::unordered_map<Key, EntryList::iterator, KeyHash> Index;
+		ScriptHookStatistics Statistics;
+};
+
+#endif
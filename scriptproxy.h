@@ -0,0 +1,155 @@
+#ifndef scriptproxy_h
+#define scriptproxy_h
+
+// Exposing C++ containers to Lua without copying
+
+/*
+-- Script::PushProxy(ScriptProxyVector(Entities)) gives scripts a userdata that reads the vector when indexed, so the cost
+	scales with what scripts touch rather than with the container size.  Pass Writable to allow assignment.
+-- Proxies hold references, the containers must outlive them.  If scripts can keep proxies past the end of the frame, attach them
+	with ScriptProxyAttach and detach before the container is destroyed; scripts then get an error instead of reading freed memory.
+-- Elements are converted with ScriptProxyPush/ScriptProxyRead.  Overload these for other element types, for instance to push
+	a nested proxy of an entity's fields.
+*/
+
+#include "script.h"
+
+#include <vector>
+#include <map>
+#include <memory>
+
+// Converters - Read consumes the value on the top of the stack and returns false if it had the wrong type
+inline void ScriptProxyPush(Script &State, int const &Data) { State.PushInteger(Data); }
+inline void ScriptProxyPush(Script &State, unsigned int const &Data) { State.PushInteger(Data); }
+inline void ScriptProxyPush(Script &State, float const &Data) { State.PushFloat(Data); }
+inline void ScriptProxyPush(Script &State, bool const &Data) { State.PushBoolean(Data); }
+inline void ScriptProxyPush(Script &State, String const &Data) { State.PushString(Data); }
+
+inline bool ScriptProxyRead(Script &State, int &Out)
+	{ if (!State.IsNumber()) { State.Pop(); return false; } Out = State.GetInteger(); return true; }
+inline bool ScriptProxyRead(Script &State, unsigned int &Out)
+	{ if (!State.IsNumber()) { State.Pop(); return false; } Out = State.GetUnsignedInteger(); return true; }
+inline bool ScriptProxyRead(Script &State, float &Out)
+	{ if (!State.IsNumber()) { State.Pop(); return false; } Out = State.GetFloat(); return true; }
+inline bool ScriptProxyRead(Script &State, bool &Out)
+	{ if (!State.IsBoolean()) { State.Pop(); return false; } Out = State.GetBoolean(); return true; }
+inline bool ScriptProxyRead(Script &State, String &Out)
+	{ if (!State.IsString()) { State.Pop(); return false; } Out = State.GetString(); return true; }
+
+// Detaching - every proxy attached to the returned flag stops using its container once the flag is set to false
+inline std::shared_ptr<bool> ScriptProxyAttach(ScriptProxyAccessors &Accessors, std::shared_ptr<bool> Flag = std::make_shared<bool>(true))
+{
+	Accessors.Attached = Flag;
+	return Flag;
+}
+
+// Indexed 1..n like a Lua array.  Assignment can't resize the vector.
+template <typename ElementType> ScriptProxyAccessors ScriptProxyVector(std::vector<ElementType> &Container, bool Writable = false)
+{
+	ScriptProxyAccessors Out;
+	std::vector<ElementType> *Target = &Container;
+
+	Out.Get = [Target](Script &State)
+	{
+		if (!State.IsNumber()) { State.Pop(); State.PushNil(); return; }
+		int Index = State.GetIndex();
+		if ((Index < 0) || ((unsigned int)Index >= Target->size())) State.PushNil();
+		else ScriptProxyPush(State, (*Target)[Index]);
+	};
+
+	if (Writable) Out.Set = [Target](Script &State)
+	{
+		ElementType Value;
+		State.Lift(-2);
+		State.AssertNumber("Proxy vector index must be a number.");
+		int Index = State.GetIndex();
+		if ((Index < 0) || ((unsigned int)Index >= Target->size()))
+		{
+			State.Pop();
+			throw Error::Input("Proxy vector index " + AsString(Index + 1) + " is out of range.");
+		}
+		if (!ScriptProxyRead(State, Value)) throw Error::Input("Proxy vector value has the wrong type.");
+		(*Target)[Index] = Value;
+	};
+
+	Out.Length = [Target](void) { return (unsigned int)Target->size(); };
+
+	Out.Next = [Target](Script &State)
+	{
+		int Index = 0;
+		if (State.IsNil()) State.Pop();
+		else
+		{
+			State.AssertNumber("Invalid key passed to proxy vector iteration.");
+			Index = State.GetIndex() + 1;
+		}
+		if ((unsigned int)Index >= Target->size()) return false;
+		State.PushIndex(Index);
+		ScriptProxyPush(State, (*Target)[Index]);
+		return true;
+	};
+
+	return Out;
+}
+
+// Indexed by key.  Assigning nil erases.  Length is the number of entries.
+template <typename KeyType, typename ValueType> ScriptProxyAccessors ScriptProxyMap(std::map<KeyType, ValueType> &Container, bool Writable = false)
+{
+	ScriptProxyAccessors Out;
+	std::map<KeyType, ValueType> *Target = &Container;
+
+	Out.Get = [Target](Script &State)
+	{
+		KeyType Key;
+		if (!ScriptProxyRead(State, Key)) { State.PushNil(); return; }
+		auto Found = Target->find(Key);
+		if (Found == Target->end()) State.PushNil();
+		else ScriptProxyPush(State, Found->second);
+	};
+
+	if (Writable) Out.Set = [Target](Script &State)
+	{
+		KeyType Key;
+		ValueType Value;
+		State.Lift(-2);
+		if (!ScriptProxyRead(State, Key))
+		{
+			State.Pop();
+			throw Error::Input("Proxy map key has the wrong type.");
+		}
+		if (State.IsNil())
+		{
+			State.Pop();
+			Target->erase(Key);
+			return;
+		}
+		if (!ScriptProxyRead(State, Value)) throw Error::Input("Proxy map value has the wrong type.");
+		(*Target)[Key] = Value;
+	};
+
+	Out.Length = [Target](void) { return (unsigned int)Target->size(); };
+
+	Out.Next = [Target](Script &State)
+	{
+		typename std::map<KeyType, ValueType>::iterator Position;
+		if (State.IsNil())
+		{
+			State.Pop();
+			Position = Target->begin();
+		}
+		else
+		{
+			KeyType Previous;
+			if (!ScriptProxyRead(State, Previous)) throw Error::Input("Invalid key passed to proxy map iteration.");
+			Position = Target->upper_bound(Previous);
+		}
+		if (Position == Target->end()) return false;
+		ScriptProxyPush(State, Position->first);
+		ScriptProxyPush(State, Position->second);
+		return true;
+	};
+
+	return Out;
+}
+
+#endif
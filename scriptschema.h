@@ -0,0 +1,234 @@
+#ifndef scriptschema_h
+#define scriptschema_h
+
+// Declarative binding of Lua tables onto C++ structures
+
+/*
+Describe a structure once per state, then read whole tables in one pass:
+	ScriptSchema<Weapon> WeaponSchema(State);
+	WeaponSchema.Field("Name", &Weapon::Name).Field("Damage", &Weapon::Damage).Field("Tint", &Weapon::Tint, false);
+	ScriptSchema<Loadout> LoadoutSchema(State);
+	LoadoutSchema.Field("Weapons", &Loadout::Weapons, WeaponSchema);
+	State.PushGlobal("Loadout");
+	LoadoutSchema.Read(State, Out, "Loadout"); // Pops the table
+-- Keys are interned in the registry when the field is declared and looked up with raw access, so reading doesn't hash key strings.
+-- Every invalid field is collected with its full path (e.g. Loadout.Weapons[3].Tint) and reported in a single Error::Input.
+-- Nested schemas must outlive the schemas that use them.  Schemas are bound to the state they were created with.
+*/
+
+#include "script.h"
+
+#include <vector>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+namespace ScriptSchemaDetail
+{
+	// Location of the value being read, only formatted when there's an error
+	struct Path
+	{
+		Path const *Parent;
+		String const *Name;
+		int Index;
+
+		Path(String const &Name) : Parent(nullptr), Name(&Name), Index(0) {}
+		Path(Path const &Parent, String const &Name) : Parent(&Parent), Name(&Name), Index(0) {}
+		Path(Path const &Parent, int Index) : Parent(&Parent), Name(nullptr), Index(Index) {}
+
+		String Format(void) const
+		{
+			String Out = Parent ? Parent->Format() : String();
+			if (Name)
+			{
+				if (!Out.empty()) Out += ".";
+				Out += *Name;
+			}
+			else Out += "[" + AsString(Index) + "]";
+			return Out;
+		}
+	};
+
+	typedef std::vector<String> Errors;
+
+	inline bool Expect(lua_State *State, bool Valid, char const *Expected, Path const &Location, Errors &Problems)
+	{
+		if (!Valid) Problems.push_back(Location.Format() + " must be " + Expected + ", but was " + lua_typename(State, lua_type(State, -1)) + ".");
+		return Valid;
+	}
+
+	// Readers - the value is on the top of the stack and is left there
+	inline void Read(lua_State *State, float &Out, Path const &Location, Errors &Problems)
+		{ if (Expect(State, lua_isnumber(State, -1), "a number", Location, Problems)) Out = lua_tonumber(State, -1); }
+
+	// Lua 5.2 truncates and 5.3 returns 0 for numbers that aren't integers, so they're checked as floating point first
+	template <typename IntegerType> void ReadIntegral(lua_State *State, IntegerType &Out, Path const &Location, Errors &Problems)
+	{
+		if (!Expect(State, lua_isnumber(State, -1), "a number", Location, Problems)) return;
+		lua_Number const Value = lua_tonumber(State, -1);
+		IntegerType const Minimum = std::numeric_limits<IntegerType>::min(), Maximum = std::numeric_limits<IntegerType>::max();
+		if (std::floor(Value) != Value) // Includes NaN
+			Problems.push_back(Location.Format() + " must be an integer, but was " + AsString(Value) + ".");
+		else if ((Value < (lua_Number)Minimum) || (Value > (lua_Number)Maximum))
+			Problems.push_back(Location.Format() + " must be from " + AsString(Minimum) + " to " + AsString(Maximum) + ", but was " + AsString(Value) + ".");
+		else Out = (IntegerType)Value;
+	}
+
+	inline void Read(lua_State *State, int &Out, Path const &Location, Errors &Problems)
+		{ ReadIntegral(State, Out, Location, Problems); }
+
+	inline void Read(lua_State *State, unsigned int &Out, Path const &Location, Errors &Problems)
+		{ ReadIntegral(State, Out, Location, Problems); }
+
+	inline void Read(lua_State *State, bool &Out, Path const &Location, Errors &Problems)
+		{ if (Expect(State, lua_isboolean(State, -1), "a boolean", Location, Problems)) Out = lua_toboolean(State, -1); }
+
+	inline void Read(lua_State *State, String &Out, Path const &Location, Errors &Problems)
+		{ if (Expect(State, lua_type(State, -1) == LUA_TSTRING, "a string", Location, Problems)) Out = lua_tostring(State, -1); }
+
+	inline void ReadFloats(lua_State *State, float *Out, int Count, char const *Expected, Path const &Location, Errors &Problems)
+	{
+		if (!Expect(State, lua_istable(State, -1), Expected, Location, Problems)) return;
+		for (int Index = 1; Index <= Count; Index++)
+		{
+			lua_rawgeti(State, -1, Index);
+			Read(State, Out[Index - 1], Path(Location, Index), Problems);
+			lua_pop(State, 1);
+		}
+	}
+
+	inline void Read(lua_State *State, Vector &Out, Path const &Location, Errors &Problems)
+	{
+		float Values[3] = {Out[0], Out[1], Out[2]};
+		ReadFloats(State, Values, 3, "a Vector table", Location, Problems);
+		Out[0] = Values[0]; Out[1] = Values[1]; Out[2] = Values[2];
+	}
+
+	inline void Read(lua_State *State, FlatVector &Out, Path const &Location, Errors &Problems)
+	{
+		float Values[2] = {Out[0], Out[1]};
+		ReadFloats(State, Values, 2, "a FlatVector table", Location, Problems);
+		Out[0] = Values[0]; Out[1] = Values[1];
+	}
+
+	inline void Read(lua_State *State, Color &Out, Path const &Location, Errors &Problems)
+	{
+		float Values[4] = {Out.Red, Out.Green, Out.Blue, Out.Alpha};
+		ReadFloats(State, Values, 4, "a Color table", Location, Problems);
+		Out.Red = Values[0]; Out.Green = Values[1]; Out.Blue = Values[2]; Out.Alpha = Values[3];
+	}
+
+	template <typename ElementType, typename ReaderType>
+		void ReadSequence(lua_State *State, std::vector<ElementType> &Out, Path const &Location, Errors &Problems, ReaderType const &ReadElement)
+	{
+		if (!Expect(State, lua_istable(State, -1), "an array table", Location, Problems)) return;
+		int const Count = lua_rawlen(State, -1);
+		Out.clear();
+		Out.resize(Count);
+		for (int Index = 1; Index <= Count; Index++)
+		{
+			lua_rawgeti(State, -1, Index);
+			ReadElement(State, Out[Index - 1], Path(Location, Index), Problems);
+			lua_pop(State, 1);
+		}
+	}
+
+	template <typename ElementType> void Read(lua_State *State, std::vector<ElementType> &Out, Path const &Location, Errors &Problems)
+	{
+		ReadSequence(State, Out, Location, Problems,
+			[](lua_State *State, ElementType &Out, Path const &Location, Errors &Problems)
+				{ Read(State, Out, Location, Problems); });
+	}
+}
+
+template <typename Type> class ScriptSchema
+{
+	public:
+		ScriptSchema(Script &State) : State(State.GetState()) {}
+		ScriptSchema(ScriptSchema const &Other) = delete;
+		ScriptSchema &operator =(ScriptSchema const &Other) = delete;
+
+		// Plain values, Vector/FlatVector/Color, and arrays of those
+		template <typename FieldType> ScriptSchema &Field(String const &Name, FieldType Type::*Member, bool Required = true)
+		{
+			return AddField(Name, Required, [Member](lua_State *State, Type &Out, ScriptSchemaDetail::Path const &Location, ScriptSchemaDetail::Errors &Problems)
+				{ ScriptSchemaDetail::Read(State, Out.*Member, Location, Problems); });
+		}
+
+		// Nested structures
+		template <typename FieldType> ScriptSchema &Field(String const &Name, FieldType Type::*Member, ScriptSchema<FieldType> const &Nested, bool Required = true)
+		{
+			ScriptSchema<FieldType> const *NestedSchema = &Nested;
+			return AddField(Name, Required, [Member, NestedSchema](lua_State *State, Type &Out, ScriptSchemaDetail::Path const &Location, ScriptSchemaDetail::Errors &Problems)
+				{ NestedSchema->ReadTop(State, Out.*Member, Location, Problems); });
+		}
+
+		// Arrays of nested structures
+		template <typename FieldType> ScriptSchema &Field(String const &Name, std::vector<FieldType> Type::*Member, ScriptSchema<FieldType> const &Nested, bool Required = true)
+		{
+			ScriptSchema<FieldType> const *NestedSchema = &Nested;
+			return AddField(Name, Required, [Member, NestedSchema](lua_State *State, Type &Out, ScriptSchemaDetail::Path const &Location, ScriptSchemaDetail::Errors &Problems)
+			{
+				ScriptSchemaDetail::ReadSequence(State, Out.*Member, Location, Problems,
+					[NestedSchema](lua_State *State, FieldType &Out, ScriptSchemaDetail::Path const &Location, ScriptSchemaDetail::Errors &Problems)
+						{ NestedSchema->ReadTop(State, Out, Location, Problems); });
+			});
+		}
+
+		// Reads the table on the top of the stack and pops it.  Throws Error::Input listing every invalid field.
+		void Read(Script &Source, Type &Out, String const &Name = "table") const
+		{
+			assert(Source.GetState() == State);
+			ScriptSchemaDetail::Errors Problems;
+			ReadTop(State, Out, ScriptSchemaDetail::Path(Name), Problems);
+			lua_pop(State, 1);
+			if (Problems.empty()) return;
+			String Message = AsString(Problems.size()) + " invalid field" + (Problems.size() == 1 ? "" : "s") + " in " + Name + ":";
+			for (auto &Problem : Problems) Message += "\n\t" + Problem;
+			throw Error::Input(Message);
+		}
+
+		// Reads the table on the top of the stack without popping it, collecting errors
+		void ReadTop(lua_State *State, Type &Out, ScriptSchemaDetail::Path const &Location, ScriptSchemaDetail::Errors &Problems) const
+		{
+			if (!ScriptSchemaDetail::Expect(State, lua_istable(State, -1), "a table", Location, Problems)) return;
+			int const Table = lua_gettop(State);
+			for (auto &Field : Fields)
+			{
+				lua_rawgeti(State, LUA_REGISTRYINDEX, Field.Key.GetIndex());
+				lua_rawget(State, Table);
+				ScriptSchemaDetail::Path const FieldLocation(Location, Field.Name);
+				if (lua_isnil(State, -1))
+				{
+					if (Field.Required) Problems.push_back(FieldLocation.Format() + " is missing.");
+				}
+				else Field.Read(State, Out, FieldLocation, Problems);
+				lua_pop(State, 1);
+			}
+			assert(lua_gettop(State) == Table);
+		}
+
+	private:
+		typedef std::function<void(lua_State *State, Type &Out, ScriptSchemaDetail::Path const &Location, ScriptSchemaDetail::Errors &Problems)> Reader;
+
+		struct FieldInfo
+		{
+			String Name;
+			ScriptReference Key;
+			bool Required;
+			Reader Read;
+		};
+
+		ScriptSchema &AddField(String const &Name, bool Required, Reader const &Read)
+		{
+			Script Interner(State);
+			lua_pushlstring(State, Name.c_str(), Name.size());
+			Fields.push_back(FieldInfo{Name, Interner.SaveReference(), Required, Read});
+			return *this;
+		}
+
+		lua_State *State;
+		std::vector<FieldInfo> Fields;
+};
+
+#endif
@@ -0,0 +1,646 @@
+#include "scriptsnapshot.h"
+
+#include "scriptbinary.h"
+
+#include <cassert>
+#include <fstream>
+#include <map>
+#include <set>
+
+namespace
+{
+	char const Magic[] = "RSNP";
+	uint32_t const Version = 2;
+
+	enum Tag : uint8_t
+	{
+		TagNil,
+		TagFalse,
+		TagTrue,
+		TagNumber,
+		TagInteger, // Lua 5.3+ integer subtype
+		TagString,
+		TagTable, // Followed by key/value pairs and TagEnd, assigned the next table id
+		TagTableReference, // Followed by a table id
+		TagLoaded, // Followed by module and field names, field is empty for the module itself
+		TagGlobals, // Like TagTable, but fills the existing globals table
+		TagEnd
+	};
+
+	// luaL_ref keeps a list of released references in the registry
+#if LUA_VERSION_NUM >= 504
+	int const FreeReferenceList = LUA_RIDX_LAST + 1;
+#else
+	int const FreeReferenceList = 0;
+#endif
+
+	typedef std::pair<String, String> LoaderPath;
+
+	String FormatLoaderPath(LoaderPath const &Path)
+	{
+		if (Path.second.empty()) return Path.first;
+		return Path.first + "." + Path.second;
+	}
+
+	// Identifies a value well enough to tell whether a library field was changed.  Tables and Lua functions only match by type.
+	String Fingerprint(lua_State *State, int Position)
+	{
+		ScriptBinaryWriter Out;
+		Out.WriteByte(lua_type(State, Position));
+		switch (lua_type(State, Position))
+		{
+			case LUA_TBOOLEAN: Out.WriteByte(lua_toboolean(State, Position)); break;
+			case LUA_TNUMBER:
+				Out.WriteNumber(lua_tonumber(State, Position));
+#if LUA_VERSION_NUM >= 503
+				Out.WriteByte(lua_isinteger(State, Position));
+#endif
+				break;
+			case LUA_TSTRING:
+			{
+				size_t Length;
+				char const *Data = lua_tolstring(State, Position, &Length);
+				Out.WriteString(Data, Length);
+				break;
+			}
+			case LUA_TLIGHTUSERDATA:
+			{
+				void *Address = lua_touserdata(State, Position);
+				Out.WriteRaw(&Address, sizeof(Address));
+				break;
+			}
+			case LUA_TFUNCTION:
+				if (lua_iscfunction(State, Position))
+				{
+					lua_CFunction Function = lua_tocfunction(State, Position);
+					Out.WriteRaw(&Function, sizeof(Function));
+				}
+				break;
+			default: break;
+		}
+		return Out.GetData();
+	}
+
+	// Library fields and registry keys in a state that has only run luaL_openlibs
+	struct Baseline
+	{
+		std::map<String, std::map<String, String> > Modules; // Module name to field fingerprints
+		std::set<String> RegistryKeys; // Fingerprints
+
+		Baseline(void)
+		{
+			lua_State *State = luaL_newstate();
+			luaL_openlibs(State);
+
+			lua_getfield(State, LUA_REGISTRYINDEX, "_LOADED");
+			lua_pushnil(State);
+			while (lua_next(State, -2))
+			{
+				if (lua_type(State, -2) == LUA_TSTRING)
+				{
+					std::map<String, String> &Fields = Modules[lua_tostring(State, -2)];
+					if (lua_istable(State, -1))
+					{
+						lua_pushnil(State);
+						while (lua_next(State, -2))
+						{
+							if (lua_type(State, -2) == LUA_TSTRING)
+								Fields[lua_tostring(State, -2)] = Fingerprint(State, -1);
+							lua_pop(State, 1);
+						}
+					}
+				}
+				lua_pop(State, 1);
+			}
+			lua_pop(State, 1);
+
+			lua_pushnil(State);
+			while (lua_next(State, LUA_REGISTRYINDEX))
+			{
+				RegistryKeys.insert(Fingerprint(State, -2));
+				lua_pop(State, 1);
+			}
+
+			lua_close(State);
+		}
+	};
+
+	// Pushes the value at a loader path, or nil
+	void PushLoaded(lua_State *State, LoaderPath const &Path)
+	{
+		lua_getfield(State, LUA_REGISTRYINDEX, "_LOADED");
+		lua_getfield(State, -1, Path.first.c_str());
+		lua_remove(State, -2);
+		if (Path.second.empty()) return;
+		if (!lua_istable(State, -1))
+		{
+			lua_pop(State, 1);
+			lua_pushnil(State);
+			return;
+		}
+		lua_pushlstring(State, Path.second.c_str(), Path.second.size());
+		lua_rawget(State, -2);
+		lua_remove(State, -2);
+	}
+
+	// Pushes a library table, the globals table for _G even if the script dropped package.loaded._G
+	void PushLibrary(lua_State *State, String const &Module)
+	{
+		if (Module == "_G") lua_rawgeti(State, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+		else PushLoaded(State, LoaderPath(Module, String()));
+	}
+
+	class Capturer
+	{
+		public:
+			Capturer(lua_State *State, std::vector<String> &Uncaptured) : State(State), Uncaptured(Uncaptured), NextTableId(1)
+			{
+				// Map the modules in the source by address.  Modules first so they aren't recorded as members of _G.
+				lua_getfield(State, LUA_REGISTRYINDEX, "_LOADED");
+				int const Loaded = lua_gettop(State);
+				lua_pushnil(State);
+				while (lua_next(State, Loaded))
+				{
+					if (lua_type(State, -2) == LUA_TSTRING)
+					{
+						String Module = lua_tostring(State, -2);
+						if (lua_istable(State, -1) || lua_isfunction(State, -1))
+							LoaderPaths.insert(std::make_pair(lua_topointer(State, -1), LoaderPath(Module, String())));
+						if (Libraries.Modules.count(Module) == 0) Required.push_back(Module);
+					}
+					lua_pop(State, 1);
+				}
+
+				// Then their members.  Required modules are loaded again when restoring, library members only if they're unchanged.
+				lua_pushnil(State);
+				while (lua_next(State, Loaded))
+				{
+					if ((lua_type(State, -2) == LUA_TSTRING) && lua_istable(State, -1))
+					{
+						String Module = lua_tostring(State, -2);
+						auto Library = Libraries.Modules.find(Module);
+						lua_pushnil(State);
+						while (lua_next(State, -2))
+						{
+							if ((lua_type(State, -2) == LUA_TSTRING) && (lua_istable(State, -1) || lua_isfunction(State, -1)))
+							{
+								String Field = lua_tostring(State, -2);
+								bool Unchanged = true;
+								if (Library != Libraries.Modules.end())
+								{
+									auto Original = Library->second.find(Field);
+									Unchanged = (Original != Library->second.end()) && (Original->second == Fingerprint(State, -1));
+								}
+								if (Unchanged) LoaderPaths.insert(std::make_pair(lua_topointer(State, -1), LoaderPath(Module, Field)));
+							}
+							lua_pop(State, 1);
+						}
+					}
+					lua_pop(State, 1);
+				}
+				lua_pop(State, 1);
+
+				// Released references
+				lua_rawgeti(State, LUA_REGISTRYINDEX, FreeReferenceList);
+				while (lua_isnumber(State, -1))
+				{
+					int Reference = lua_tointeger(State, -1);
+					lua_pop(State, 1);
+					if ((Reference == 0) || !FreeReferences.insert(Reference).second) break;
+					lua_rawgeti(State, LUA_REGISTRYINDEX, Reference);
+				}
+				lua_pop(State, 1);
+			}
+
+			// Library fields that differ from a fresh state (e.g. package.path), then the modules to require.  Changed globals are
+			// captured with the rest of the globals, only the removed ones are written here.
+			void WriteLibraries(void)
+			{
+				for (auto &Library : Libraries.Modules)
+				{
+					bool const Globals = (Library.first == "_G");
+					LoaderPath Module(Library.first, String());
+					PushLibrary(State, Module.first);
+					if (!lua_istable(State, -1))
+					{
+						lua_pop(State, 1);
+						continue;
+					}
+					int const Table = lua_gettop(State);
+
+					if (!Globals)
+					{
+						lua_pushnil(State);
+						while (lua_next(State, Table))
+						{
+							if (lua_type(State, -2) == LUA_TSTRING)
+							{
+								LoaderPath Field(Module.first, lua_tostring(State, -2));
+								auto Original = Library.second.find(Field.second);
+								if ((Original == Library.second.end()) || (Original->second != Fingerprint(State, -1)))
+									WriteLibraryField(Field, lua_gettop(State));
+							}
+							lua_pop(State, 1);
+						}
+					}
+
+					// Removed fields, e.g. when sandboxing
+					for (auto &Original : Library.second)
+					{
+						lua_pushlstring(State, Original.first.c_str(), Original.first.size());
+						lua_rawget(State, Table);
+						if (lua_isnil(State, -1)) WriteLibraryField(LoaderPath(Module.first, Original.first), lua_gettop(State));
+						lua_pop(State, 1);
+					}
+					lua_pop(State, 1);
+				}
+				Output.WriteByte(TagEnd);
+
+				for (auto &Module : Required)
+				{
+					Output.WriteByte(TagString);
+					Output.WriteString(Module);
+				}
+				Output.WriteByte(TagEnd);
+			}
+
+			void WriteGlobals(void)
+			{
+				lua_rawgeti(State, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+				WriteTable(lua_gettop(State), "_G", TagGlobals);
+				lua_pop(State, 1);
+			}
+
+			void WriteRegistry(void)
+			{
+				lua_pushnil(State);
+				while (lua_next(State, LUA_REGISTRYINDEX))
+				{
+					int const Key = lua_gettop(State) - 1, Value = lua_gettop(State);
+					if ((Libraries.RegistryKeys.count(Fingerprint(State, Key)) > 0) || IsFreeReference(Key))
+					{
+						lua_pop(State, 1);
+						continue;
+					}
+
+					String Path = "registry" + Script::DescribeKey(State, Key);
+					if (lua_type(State, Key) == LUA_TSTRING)
+					{
+						if (!Capturable(Value)) Report(Path, Value);
+						else
+						{
+							Output.WriteByte(TagString);
+							Output.WriteString(lua_tostring(State, Key));
+							WriteValue(Value, Path);
+						}
+					}
+					// References and slots belong to objects in the source process, they can't be matched up in the target
+					else if (lua_type(State, Key) == LUA_TNUMBER) Uncaptured.push_back(Path + " (reference)");
+					else if (lua_type(State, Key) == LUA_TLIGHTUSERDATA) Uncaptured.push_back(Path + " (slot)");
+					else Report(Path + " key", Key);
+					lua_pop(State, 1);
+				}
+				Output.WriteByte(TagEnd);
+			}
+
+			String const &GetData(void) const { return Output.GetData(); }
+
+		private:
+			bool Capturable(int Position)
+			{
+				switch (lua_type(State, Position))
+				{
+					case LUA_TNIL: case LUA_TBOOLEAN: case LUA_TNUMBER: case LUA_TSTRING: case LUA_TTABLE: return true;
+					default: return LoaderPaths.count(lua_topointer(State, Position)) > 0;
+				}
+			}
+
+			bool IsFreeReference(int Position)
+			{
+				if (lua_type(State, Position) != LUA_TNUMBER) return false;
+				lua_Number Key = lua_tonumber(State, Position);
+				return (Key == FreeReferenceList) || (FreeReferences.count((int)Key) && (Key == (int)Key));
+			}
+
+			void Report(String const &Path, int Position)
+				{ Uncaptured.push_back(Path + " (" + lua_typename(State, lua_type(State, Position)) + ")"); }
+
+			void WriteLibraryField(LoaderPath const &Field, int Position)
+			{
+				if (!Capturable(Position))
+				{
+					Report(FormatLoaderPath(Field), Position);
+					return;
+				}
+				Output.WriteByte(TagString);
+				Output.WriteString(Field.first);
+				Output.WriteString(Field.second);
+				WriteValue(Position, FormatLoaderPath(Field));
+			}
+
+			void WriteValue(int Position, String const &Path)
+			{
+				switch (lua_type(State, Position))
+				{
+					case LUA_TNIL: Output.WriteByte(TagNil); return;
+					case LUA_TBOOLEAN: Output.WriteByte(lua_toboolean(State, Position) ? TagTrue : TagFalse); return;
+					case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+						if (lua_isinteger(State, Position))
+						{
+							Output.WriteByte(TagInteger);
+							Output.WriteLong(lua_tointeger(State, Position));
+							return;
+						}
+#endif
+						Output.WriteByte(TagNumber);
+						Output.WriteNumber(lua_tonumber(State, Position));
+						return;
+					case LUA_TSTRING:
+					{
+						size_t Length;
+						char const *Data = lua_tolstring(State, Position, &Length);
+						Output.WriteByte(TagString);
+						Output.WriteString(Data, Length);
+						return;
+					}
+					default: break;
+				}
+
+				void const *Address = lua_topointer(State, Position);
+				auto Loaded = LoaderPaths.find(Address);
+				if (Loaded != LoaderPaths.end())
+				{
+					Output.WriteByte(TagLoaded);
+					Output.WriteString(Loaded->second.first);
+					Output.WriteString(Loaded->second.second);
+					return;
+				}
+
+				assert(lua_istable(State, Position));
+				auto Found = TableIds.find(Address);
+				if (Found != TableIds.end())
+				{
+					Output.WriteByte(TagTableReference);
+					Output.WriteInteger(Found->second);
+					return;
+				}
+				WriteTable(Position, Path, TagTable);
+			}
+
+			void WriteTable(int Position, String const &Path, Tag Kind)
+			{
+				TableIds[lua_topointer(State, Position)] = NextTableId++;
+				Output.WriteByte(Kind);
+
+				if (lua_getmetatable(State, Position))
+				{
+					lua_pop(State, 1);
+					Uncaptured.push_back(Path + " (metatable)");
+				}
+
+				if (!lua_checkstack(State, 4)) throw Error::Input("Tables are nested too deeply to capture at " + Path + ".");
+				lua_pushnil(State);
+				while (lua_next(State, Position))
+				{
+					int const Key = lua_gettop(State) - 1, Value = lua_gettop(State);
+					String Child = Path + Script::DescribeKey(State, Key);
+					if (!Capturable(Key)) Report(Child + " key", Key);
+					else if (!Capturable(Value)) Report(Child, Value);
+					else
+					{
+						WriteValue(Key, Child + " key");
+						WriteValue(Value, Child);
+					}
+					lua_pop(State, 1);
+				}
+				Output.WriteByte(TagEnd);
+			}
+
+			lua_State *State;
+			std::vector<String> &Uncaptured;
+			Baseline Libraries;
+			ScriptBinaryWriter Output;
+			std::map<void const *, LoaderPath> LoaderPaths;
+			std::vector<String> Required;
+			std::set<int> FreeReferences;
+			std::map<void const *, uint32_t> TableIds;
+			uint32_t NextTableId;
+	};
+
+	class Restorer
+	{
+		public:
+			Restorer(lua_State *State, ScriptBinaryReader &Input, std::vector<String> &Unresolved) :
+				State(State), Input(Input), Unresolved(Unresolved), Tables(0), TableCount(0) {}
+
+			void Read(void)
+			{
+				lua_newtable(State);
+				Tables = lua_gettop(State);
+
+				// Library fields, before requiring so changes to package.path and the like apply
+				while (true)
+				{
+					uint8_t Kind = Input.ReadByte();
+					if (Kind == TagEnd) break;
+					if (Kind != TagString) throw Error::Input("Snapshot image has a corrupt library entry.");
+					LoaderPath Field;
+					Field.first = Input.ReadString();
+					Field.second = Input.ReadString();
+					PushLibrary(State, Field.first);
+					size_t const InitialUnresolved = Unresolved.size();
+					lua_pushlstring(State, Field.second.c_str(), Field.second.size());
+					ReadValue(Input.ReadByte());
+					if (lua_istable(State, -3) && (Unresolved.size() == InitialUnresolved)) lua_rawset(State, -3);
+					else lua_pop(State, 2);
+					lua_pop(State, 1);
+				}
+
+				while (true)
+				{
+					uint8_t Kind = Input.ReadByte();
+					if (Kind == TagEnd) break;
+					if (Kind != TagString) throw Error::Input("Snapshot image has a corrupt module entry.");
+					Require(Input.ReadString());
+				}
+
+				if (Input.ReadByte() != TagGlobals) throw Error::Input("Snapshot image is missing globals.");
+				lua_rawgeti(State, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+				ReadTable();
+				lua_pop(State, 1);
+
+				while (true)
+				{
+					uint8_t Kind = Input.ReadByte();
+					if (Kind == TagEnd) break;
+					if (Kind != TagString) throw Error::Input("Snapshot image has a corrupt registry entry.");
+					String Key = Input.ReadString();
+					lua_pushlstring(State, Key.c_str(), Key.size());
+					ReadValue(Input.ReadByte());
+					lua_rawset(State, LUA_REGISTRYINDEX);
+				}
+
+				lua_pop(State, 1);
+				assert(lua_gettop(State) == Tables - 1);
+			}
+
+		private:
+			void Require(String const &Module)
+			{
+				PushLoaded(State, LoaderPath(Module, String()));
+				bool Loaded = !lua_isnil(State, -1);
+				lua_pop(State, 1);
+				if (Loaded) return;
+
+				lua_getglobal(State, "require");
+				lua_pushlstring(State, Module.c_str(), Module.size());
+				if (lua_pcall(State, 1, 0, 0) != LUA_OK)
+				{
+					Unresolved.push_back(Module + " (" + (lua_isstring(State, -1) ? String(lua_tostring(State, -1)) : String("require failed")) + ")");
+					lua_pop(State, 1);
+				}
+			}
+
+			void ReadValue(uint8_t Kind)
+			{
+				switch (Kind)
+				{
+					case TagNil: lua_pushnil(State); break;
+					case TagFalse: lua_pushboolean(State, false); break;
+					case TagTrue: lua_pushboolean(State, true); break;
+					case TagNumber: lua_pushnumber(State, Input.ReadNumber()); break;
+					case TagInteger: lua_pushinteger(State, (lua_Integer)Input.ReadLong()); break;
+					case TagString:
+					{
+						String Data = Input.ReadString();
+						lua_pushlstring(State, Data.c_str(), Data.size());
+						break;
+					}
+					case TagTable:
+						lua_newtable(State);
+						ReadTable();
+						break;
+					case TagTableReference:
+					{
+						uint32_t Id = Input.ReadInteger();
+						if ((Id == 0) || (Id > TableCount)) throw Error::Input("Snapshot image has an invalid table reference.");
+						lua_rawgeti(State, Tables, Id);
+						break;
+					}
+					case TagLoaded:
+					{
+						LoaderPath Path;
+						Path.first = Input.ReadString();
+						Path.second = Input.ReadString();
+						PushLoaded(State, Path);
+						if (lua_isnil(State, -1)) Unresolved.push_back(FormatLoaderPath(Path));
+						break;
+					}
+					default: throw Error::Input("Snapshot image has an unknown value type.");
+				}
+			}
+
+			// Fills the table on the top of the stack
+			void ReadTable(void)
+			{
+				lua_pushvalue(State, -1);
+				lua_rawseti(State, Tables, ++TableCount);
+
+				if (!lua_checkstack(State, 4)) throw Error::Input("Snapshot image tables are nested too deeply.");
+				while (true)
+				{
+					uint8_t Kind = Input.ReadByte();
+					if (Kind == TagEnd) break;
+					ReadValue(Kind);
+					ReadValue(Input.ReadByte());
+					if (lua_isnil(State, -2) || lua_isnil(State, -1)) lua_pop(State, 2); // Unresolved loader paths
+					else lua_rawset(State, -3);
+				}
+			}
+
+			lua_State *State;
+			ScriptBinaryReader &Input;
+			std::vector<String> &Unresolved;
+			int Tables;
+			uint32_t TableCount;
+	};
+}
+
+ScriptSnapshot ScriptSnapshot::Capture(Script &Source)
+{
+	ScriptSnapshot Out;
+	lua_State *State = Source.GetState();
+#ifndef NDEBUG
+	unsigned int InitialHeight = Source.Height();
+#endif
+
+	Capturer Body(State, Out.Uncaptured);
+	Body.WriteLibraries();
+	Body.WriteGlobals();
+	Body.WriteRegistry();
+
+	ScriptBinaryWriter Header;
+	Header.WriteRaw(Magic, 4);
+	Header.WriteInteger(Version);
+	Header.WriteInteger(Out.Uncaptured.size());
+	for (auto &Path : Out.Uncaptured) Header.WriteString(Path);
+
+	Out.Image = Header.GetData();
+	Out.BodyStart = Out.Image.size();
+	Out.Image += Body.GetData();
+#ifndef NDEBUG
+	assert(Source.Height() == InitialHeight);
+#endif
+	return Out;
+}
+
+ScriptSnapshot ScriptSnapshot::Load(String const &Filename)
+{
+	return ScriptSnapshot(ScriptBinaryReadFile(Filename, "snapshot"));
+}
+
+ScriptSnapshot::ScriptSnapshot(String const &Image) : Image(Image), BodyStart(0)
+{
+	ScriptBinaryReader Input(this->Image);
+	char FileMagic[4];
+	Input.ReadRaw(FileMagic, 4);
+	if (memcmp(FileMagic, Magic, 4) != 0) throw Error::Input("Data is not a script snapshot image.");
+	if (Input.ReadInteger() != Version) throw Error::Input("Script snapshot image is from an incompatible version.");
+	uint32_t UncapturedCount = Input.ReadInteger();
+	for (uint32_t Index = 0; Index < UncapturedCount; Index++)
+		Uncaptured.push_back(Input.ReadString());
+	BodyStart = this->Image.size() - Input.Remaining();
+}
+
+void ScriptSnapshot::Save(String const &Filename) const
+{
+	std::ofstream File(Filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!File) throw Error::System("Couldn't open snapshot file " + Filename + " for writing.");
+	File.write(Image.data(), Image.size());
+	if (!File) throw Error::System("Couldn't write snapshot file " + Filename + ".");
+}
+
+String const &ScriptSnapshot::GetImage(void) const
+	{ return Image; }
+
+std::vector<String> const &ScriptSnapshot::GetUncaptured(void) const
+	{ return Uncaptured; }
+
+std::vector<String> ScriptSnapshot::Restore(Script &Target) const
+{
+	std::vector<String> Unresolved;
+	unsigned int const InitialHeight = Target.Height();
+	ScriptBinaryReader Input(Image);
+	Input.Skip(BodyStart);
+	try { Restorer(Target.GetState(), Input, Unresolved).Read(); }
+	catch (...)
+	{
+		lua_settop(Target.GetState(), InitialHeight);
+		throw;
+	}
+	assert(Target.Height() == InitialHeight);
+	return Unresolved;
+}
+
+ScriptSnapshot::ScriptSnapshot(void) : BodyStart(0) {}
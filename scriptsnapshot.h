@@ -0,0 +1,45 @@
+#ifndef scriptsnapshot_h
+#define scriptsnapshot_h
+
+// Binary images of the data in an initialized state
+
+/*
+-- Capture a state after running the init scripts, then Restore the image into new states instead of re-running them.
+-- Globals and string-keyed registry values (SaveInternal) are captured if they're nil, booleans, numbers, strings or tables of those.
+	Shared and cyclic tables stay shared and cyclic.
+-- Functions and tables in package.loaded are captured by loader path (e.g. string.format, mymodule.update).  Modules loaded with require
+	are required again when restoring, so changes scripts made to them afterwards aren't captured.
+-- Library fields that differ from a fresh state (e.g. package.path, or functions removed for sandboxing) are captured and restored
+	before requiring.  Standard globals removed from _G (e.g. os = nil) are removed when restoring too.
+-- Anything else (script-defined functions, PushFunction functions, userdata, metatables, SaveReference and SaveSlot values) is skipped
+	and listed by GetUncaptured.
+-- Restore into a fresh Script, it overlays the existing globals.
+*/
+
+#include "script.h"
+
+#include <vector>
+
+class ScriptSnapshot
+{
+	public:
+		static ScriptSnapshot Capture(Script &Source);
+		static ScriptSnapshot Load(String const &Filename); // Throws Error::System if the file can't be read, Error::Input if it's not an image
+		ScriptSnapshot(String const &Image); // Throws Error::Input if it's not an image
+
+		void Save(String const &Filename) const; // Throws Error::System
+		String const &GetImage(void) const;
+		std::vector<String> const &GetUncaptured(void) const; // Paths and reasons for values that were skipped when capturing
+
+		// Returns the loader paths and modules that couldn't be found in the target, which are left nil
+		std::vector<String> Restore(Script &Target) const;
+
+	private:
+		ScriptSnapshot(void);
+
+		String Image;
+		size_t BodyStart;
+		std::vector<String> Uncaptured;
+};
+
+#endif
@@ -0,0 +1,367 @@
+#include "scriptstore.h"
+
+#include "scriptbinary.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <map>
+
+namespace
+{
+	char MetatableKey;
+
+	void PushNumberKey(lua_State *State, double Key)
+	{
+#if LUA_VERSION_NUM >= 503
+		// Tables store integral float keys as integers, so that's what scripts put in
+		lua_Integer Integer;
+		if (lua_numbertointeger(Key, &Integer))
+		{
+			lua_pushinteger(State, Integer);
+			return;
+		}
+#endif
+		lua_pushnumber(State, Key);
+	}
+}
+
+class ScriptDataStore::Freezer
+{
+	public:
+		Freezer(lua_State *State, ScriptDataStore &Out) : State(State), Out(Out) {}
+
+		uint32_t ConvertTable(int Position, String const &Path)
+		{
+			uint32_t const Index = Out.Tables.size();
+			TableIndices[lua_topointer(State, Position)] = Index;
+			Out.Tables.emplace_back();
+
+			if (!lua_checkstack(State, 4)) throw Error::Input("Tables are nested too deeply to freeze at " + Path + ".");
+			Table Built;
+			Built.Array.resize(lua_rawlen(State, Position));
+			lua_pushnil(State);
+			while (lua_next(State, Position))
+			{
+				int const Key = lua_gettop(State) - 1;
+				switch (lua_type(State, Key))
+				{
+					case LUA_TNUMBER:
+					{
+						double Number = lua_tonumber(State, Key);
+						if ((Number >= 1) && (Number <= Built.Array.size()) && (Number == std::floor(Number)))
+							Built.Array[(size_t)Number - 1] = Convert(Path, Key);
+						else Built.Numbered.push_back(std::make_pair(Number, Convert(Path, Key)));
+						break;
+					}
+					case LUA_TSTRING:
+					{
+						size_t Length;
+						char const *Data = lua_tolstring(State, Key, &Length);
+						Built.Named.push_back(std::make_pair(Intern(Data, Length), Convert(Path, Key)));
+						break;
+					}
+					default: throw Error::Input("Can't freeze " + Path + Script::DescribeKey(State, Key) + ", keys must be strings or numbers.");
+				}
+				lua_pop(State, 1);
+			}
+
+			std::sort(Built.Numbered.begin(), Built.Numbered.end(),
+				[](std::pair<double, Value> const &First, std::pair<double, Value> const &Second) { return First.first < Second.first; });
+			std::vector<String> const &Strings = Out.Strings;
+			std::sort(Built.Named.begin(), Built.Named.end(),
+				[&Strings](std::pair<uint32_t, Value> const &First, std::pair<uint32_t, Value> const &Second)
+					{ return Strings[First.first] < Strings[Second.first]; });
+			Out.Tables[Index] = std::move(Built);
+			return Index;
+		}
+
+	private:
+		// Converts the value on the top of the stack, Key is its key in the table at Path
+		Value Convert(String const &Path, int Key)
+		{
+			Value Out;
+			switch (lua_type(State, -1))
+			{
+				case LUA_TBOOLEAN: Out.Type = TypeBoolean; Out.Boolean = lua_toboolean(State, -1); break;
+				case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+					if (lua_isinteger(State, -1))
+					{
+						Out.Type = TypeInteger;
+						Out.Integer = lua_tointeger(State, -1);
+						break;
+					}
+#endif
+					Out.Type = TypeNumber;
+					Out.Number = lua_tonumber(State, -1);
+					break;
+				case LUA_TSTRING:
+				{
+					size_t Length;
+					char const *Data = lua_tolstring(State, -1, &Length);
+					Out.Type = TypeString;
+					Out.Index = Intern(Data, Length);
+					break;
+				}
+				case LUA_TTABLE:
+				{
+					Out.Type = TypeTable;
+					auto Found = TableIndices.find(lua_topointer(State, -1));
+					if (Found != TableIndices.end()) Out.Index = Found->second;
+					else Out.Index = ConvertTable(lua_gettop(State), Path + Script::DescribeKey(State, Key));
+					break;
+				}
+				default: throw Error::Input("Can't freeze " + Path + Script::DescribeKey(State, Key) + ", " +
+					lua_typename(State, lua_type(State, -1)) + " values aren't supported.");
+			}
+			return Out;
+		}
+
+		uint32_t Intern(char const *Data, size_t Length)
+		{
+			String Key(Data, Length);
+			auto Found = StringIndices.find(Key);
+			if (Found != StringIndices.end()) return Found->second;
+			uint32_t Index = Out.Strings.size();
+			Out.Strings.push_back(Key);
+			StringIndices[Key] = Index;
+			return Index;
+		}
+
+		lua_State *State;
+		ScriptDataStore &Out;
+		std::map<void const *, uint32_t> TableIndices;
+		std::map<String, uint32_t> StringIndices;
+};
+
+ScriptDataStore ScriptDataStore::Freeze(Script &Source)
+{
+	Source.AssertTable("Only tables can be frozen into a data store.");
+	ScriptDataStore Out;
+	Freezer(Source.GetState(), Out).ConvertTable(Source.Height(), "root");
+	Source.Pop();
+	return Out;
+}
+
+ScriptDataStore ScriptDataStore::Load(String const &Filename)
+{
+	String const Code = ScriptBinaryReadFile(Filename, "data store");
+
+	// ScriptDataBuilder output is a bare table expression, but allow files that return the table themselves
+	Script Temporary;
+	lua_State *State = Temporary.GetState();
+	String const ChunkName = "@" + Filename;
+	String const Expression = "return " + Code;
+	if (luaL_loadbuffer(State, Expression.c_str(), Expression.size(), ChunkName.c_str()) != LUA_OK)
+	{
+		Temporary.Pop();
+		if (luaL_loadbuffer(State, Code.c_str(), Code.size(), ChunkName.c_str()) != LUA_OK)
+			throw Error::Input("Couldn't load data store file " + Filename + ": " + Temporary.GetString());
+	}
+	if (lua_pcall(State, 0, 1, 0) != LUA_OK)
+		throw Error::Input("Couldn't run data store file " + Filename + ": " + (Temporary.IsString() ? Temporary.GetString() : Temporary.GetType()));
+	if (!Temporary.IsTable()) throw Error::Input("Data store file " + Filename + " didn't return a table.");
+	return Freeze(Temporary);
+}
+
+void ScriptDataStore::Push(Script &Target) const
+{
+	assert(!Tables.empty());
+	PushTable(Target.GetState(), 0);
+}
+
+ScriptDataStore::ScriptDataStore(void) {}
+
+void ScriptDataStore::PushValue(lua_State *State, Value const &Data) const
+{
+	switch (Data.Type)
+	{
+		case TypeNil: lua_pushnil(State); break;
+		case TypeBoolean: lua_pushboolean(State, Data.Boolean); break;
+		case TypeNumber: lua_pushnumber(State, Data.Number); break;
+		case TypeInteger: lua_pushinteger(State, Data.Integer); break;
+		case TypeString: lua_pushlstring(State, Strings[Data.Index].c_str(), Strings[Data.Index].size()); break;
+		case TypeTable: PushTable(State, Data.Index); break;
+	}
+}
+
+void ScriptDataStore::PushTable(lua_State *State, uint32_t Index) const
+{
+	// Proxies are cached per state so nested tables keep their identity, the cache is weak so unused proxies can be collected.
+	// Keyed by a member rather than this, which embedders may use as a slot key for their own data.
+	Script Target(State);
+	Target.PushSlot(&Tables);
+	if (Target.IsNil())
+	{
+		Target.Pop();
+		Target.PushTable();
+		lua_createtable(State, 0, 1);
+		lua_pushliteral(State, "v");
+		lua_setfield(State, -2, "__mode");
+		lua_setmetatable(State, -2);
+		Target.Duplicate(-1);
+		Target.SaveSlot(&Tables);
+	}
+	lua_rawgeti(State, -1, Index + 1);
+	if (!Target.IsNil())
+	{
+		lua_remove(State, -2);
+		return;
+	}
+	Target.Pop();
+
+	Proxy *NewProxy = (Proxy *)lua_newuserdata(State, sizeof(Proxy));
+	NewProxy->Store = this;
+	NewProxy->Table = Index;
+
+	static luaL_Reg const Methods[] =
+	{
+		{"__index", HandleIndex},
+		{"__len", HandleLength},
+		{"__pairs", HandlePairs},
+		{"__ipairs", HandleIndexPairs},
+		{"__newindex", HandleNewIndex},
+		{nullptr, nullptr}
+	};
+	Target.PushMetatable(&MetatableKey, Methods, "ScriptDataStore");
+	lua_setmetatable(State, -2);
+
+	Target.Duplicate(-1);
+	lua_rawseti(State, -3, Index + 1);
+	lua_remove(State, -2);
+}
+
+size_t ScriptDataStore::GetSize(Table const &Source)
+	{ return Source.Array.size() + Source.Numbered.size() + Source.Named.size(); }
+
+size_t ScriptDataStore::Locate(Table const &Source, lua_State *State, int Key) const
+{
+	size_t const Missing = GetSize(Source);
+	switch (lua_type(State, Key))
+	{
+		case LUA_TNUMBER:
+		{
+			double Number = lua_tonumber(State, Key);
+			if ((Number >= 1) && (Number <= Source.Array.size()) && (Number == std::floor(Number)))
+				return (size_t)Number - 1;
+			auto Found = std::lower_bound(Source.Numbered.begin(), Source.Numbered.end(), Number,
+				[](std::pair<double, Value> const &Entry, double Number) { return Entry.first < Number; });
+			if ((Found == Source.Numbered.end()) || (Found->first != Number)) return Missing;
+			return Source.Array.size() + (Found - Source.Numbered.begin());
+		}
+		case LUA_TSTRING:
+		{
+			size_t Length;
+			char const *Data = lua_tolstring(State, Key, &Length);
+			auto Found = std::lower_bound(Source.Named.begin(), Source.Named.end(), 0,
+				[this, Data, Length](std::pair<uint32_t, Value> const &Entry, int)
+					{ return Strings[Entry.first].compare(0, String::npos, Data, Length) < 0; });
+			if ((Found == Source.Named.end()) || (Strings[Found->first].compare(0, String::npos, Data, Length) != 0)) return Missing;
+			return Source.Array.size() + Source.Numbered.size() + (Found - Source.Named.begin());
+		}
+		default: return Missing;
+	}
+}
+
+ScriptDataStore::Value const &ScriptDataStore::GetEntry(Table const &Source, size_t Position)
+{
+	if (Position < Source.Array.size()) return Source.Array[Position];
+	Position -= Source.Array.size();
+	if (Position < Source.Numbered.size()) return Source.Numbered[Position].second;
+	Position -= Source.Numbered.size();
+	assert(Position < Source.Named.size());
+	return Source.Named[Position].second;
+}
+
+bool ScriptDataStore::PushEntry(lua_State *State, Table const &Source, size_t Position) const
+{
+	Value const &Data = GetEntry(Source, Position);
+	if (Data.Type == TypeNil) return false; // Holes in the array part
+	if (Position < Source.Array.size()) lua_pushinteger(State, Position + 1);
+	else if (Position - Source.Array.size() < Source.Numbered.size())
+		PushNumberKey(State, Source.Numbered[Position - Source.Array.size()].first);
+	else
+	{
+		String const &Key = Strings[Source.Named[Position - Source.Array.size() - Source.Numbered.size()].first];
+		lua_pushlstring(State, Key.c_str(), Key.size());
+	}
+	PushValue(State, Data);
+	return true;
+}
+
+ScriptDataStore::Proxy const &ScriptDataStore::CheckProxy(lua_State *State, int Position)
+	{ return *(Proxy const *)Script::CheckUserdata(State, Position, &MetatableKey, "data store table expected"); }
+
+int ScriptDataStore::HandleIndex(lua_State *State)
+{
+	Proxy const &Target = CheckProxy(State, 1);
+	Table const &Source = Target.Store->Tables[Target.Table];
+	size_t Position = Target.Store->Locate(Source, State, 2);
+	if (Position < GetSize(Source)) Target.Store->PushValue(State, GetEntry(Source, Position));
+	else lua_pushnil(State);
+	return 1;
+}
+
+int ScriptDataStore::HandleLength(lua_State *State)
+{
+	Proxy const &Target = CheckProxy(State, 1);
+	lua_pushinteger(State, Target.Store->Tables[Target.Table].Array.size());
+	return 1;
+}
+
+int ScriptDataStore::HandlePairs(lua_State *State)
+{
+	CheckProxy(State, 1);
+	lua_pushcfunction(State, HandleNext);
+	lua_pushvalue(State, 1);
+	lua_pushnil(State);
+	return 3;
+}
+
+int ScriptDataStore::HandleNext(lua_State *State)
+{
+	Proxy const &Target = CheckProxy(State, 1);
+	Table const &Source = Target.Store->Tables[Target.Table];
+	size_t const Total = GetSize(Source);
+
+	// Start after the previous key
+	size_t Position = 0;
+	lua_settop(State, 2);
+	if (!lua_isnil(State, 2))
+	{
+		Position = Target.Store->Locate(Source, State, 2);
+		if (Position >= Total) return luaL_error(State, "invalid key to 'next'");
+		Position++;
+	}
+
+	for (; Position < Total; Position++)
+		if (Target.Store->PushEntry(State, Source, Position)) return 2;
+	lua_pushnil(State);
+	return 1;
+}
+
+int ScriptDataStore::HandleIndexPairs(lua_State *State)
+{
+	CheckProxy(State, 1);
+	lua_pushcfunction(State, HandleIndexNext);
+	lua_pushvalue(State, 1);
+	lua_pushinteger(State, 0);
+	return 3;
+}
+
+int ScriptDataStore::HandleIndexNext(lua_State *State)
+{
+	Proxy const &Target = CheckProxy(State, 1);
+	Table const &Source = Target.Store->Tables[Target.Table];
+	lua_Integer Index = lua_tointeger(State, 2);
+	if ((Index < 0) || ((size_t)Index >= Source.Array.size()) || (Source.Array[Index].Type == TypeNil)) return 0;
+	lua_pushinteger(State, Index + 1);
+	Target.Store->PushValue(State, Source.Array[Index]);
+	return 2;
+}
+
+int ScriptDataStore::HandleNewIndex(lua_State *State)
+{
+	return luaL_error(State, "data store tables are read-only");
+}
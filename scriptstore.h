@@ -0,0 +1,83 @@
+#ifndef scriptstore_h
+#define scriptstore_h
+
+// Immutable data shared by many states
+
+/*
+-- Freeze a table once, then Push it into any number of states, on any threads.
+-- Scripts see read-only proxies supporting indexing, #, pairs and ipairs.  Nested tables are proxies too, nothing is copied into the states.
+	Each state gets one proxy per table, so proxies compare equal and can be used as keys.
+-- The store is never modified after it's frozen, so reading doesn't lock.  It must outlive the states it's pushed into and must not be moved after pushing.
+-- Only booleans, numbers, strings and tables of those can be frozen, with string or number keys.  Metatables are ignored.
+-- Iteration order is the array part, then other number keys in order, then string keys in order.
+*/
+
+#include "script.h"
+
+#include <cstdint>
+#include <vector>
+
+class ScriptDataStore
+{
+	public:
+		// Freezes the table on the top of the stack and pops it.  Throws Error::Input on values that can't be frozen.
+		static ScriptDataStore Freeze(Script &Source);
+		// Runs a file of ScriptDataBuilder output (a bare table) or a chunk returning a table in a temporary state and freezes the result.
+		// Throws Error::System if the file can't be read, Error::Input if it doesn't produce a table that can be frozen.
+		static ScriptDataStore Load(String const &Filename);
+
+		// Pushes the read-only proxy for the root table
+		void Push(Script &Target) const;
+
+	private:
+		enum ValueType : uint8_t { TypeNil, TypeBoolean, TypeNumber, TypeInteger, TypeString, TypeTable };
+		struct Value
+		{
+			ValueType Type;
+			union
+			{
+				bool Boolean;
+				double Number;
+				lua_Integer Integer; // Lua 5.3+ integer subtype
+				uint32_t Index; // Into Strings or Tables
+			};
+			Value(void) : Type(TypeNil), Number(0) {}
+		};
+		struct Table
+		{
+			std::vector<Value> Array; // Keys 1..n
+			std::vector<std::pair<double, Value> > Numbered; // Sorted
+			std::vector<std::pair<uint32_t, Value> > Named; // Sorted by string
+		};
+		struct Proxy
+		{
+			ScriptDataStore const *Store;
+			uint32_t Table;
+		};
+		class Freezer;
+
+		ScriptDataStore(void);
+
+		void PushValue(lua_State *State, Value const &Data) const;
+		void PushTable(lua_State *State, uint32_t Index) const;
+		// Positions run through the array part, then the number keys, then the string keys
+		static size_t GetSize(Table const &Source);
+		size_t Locate(Table const &Source, lua_State *State, int Key) const; // Returns the size if the key isn't found
+		static Value const &GetEntry(Table const &Source, size_t Position);
+		bool PushEntry(lua_State *State, Table const &Source, size_t Position) const;
+
+		static Proxy const &CheckProxy(lua_State *State, int Position);
+
+		static int HandleIndex(lua_State *State);
+		static int HandleLength(lua_State *State);
+		static int HandlePairs(lua_State *State);
+		static int HandleNext(lua_State *State);
+		static int HandleIndexPairs(lua_State *State);
+		static int HandleIndexNext(lua_State *State);
+		static int HandleNewIndex(lua_State *State);
+
+		std::vector<String> Strings;
+		std::vector<Table> Tables;
+};
+
+#endif
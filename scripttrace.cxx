@@ -0,0 +1,415 @@
+#include "scripttrace.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <set>
+#include <thread>
+
+namespace
+{
+	char const Magic[] = "RSTR";
+	uint32_t const Version = 3;
+	size_t const FlushSize = 1 << 16;
+
+	enum EventKind : uint8_t { EventDo = 1, EventHook = 2, EventSave = 3 };
+
+	enum Tag : uint8_t
+	{
+		TagNil,
+		TagFalse,
+		TagTrue,
+		TagNumber,
+		TagInteger, // Lua 5.3+ integer subtype
+		TagString,
+		TagTable, // Followed by key/value pairs and TagEnd
+		TagUnsupported, // Followed by the type name, replayed as nil
+		TagEnd
+	};
+
+	void WriteValue(ScriptBinaryWriter &Out, lua_State *State, int Position, std::set<void const *> &Visited)
+	{
+		switch (lua_type(State, Position))
+		{
+			case LUA_TNIL: Out.WriteByte(TagNil); return;
+			case LUA_TBOOLEAN: Out.WriteByte(lua_toboolean(State, Position) ? TagTrue : TagFalse); return;
+			case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+				if (lua_isinteger(State, Position))
+				{
+					Out.WriteByte(TagInteger);
+					Out.WriteLong(lua_tointeger(State, Position));
+					return;
+				}
+#endif
+				Out.WriteByte(TagNumber);
+				Out.WriteNumber(lua_tonumber(State, Position));
+				return;
+			case LUA_TSTRING:
+			{
+				size_t Length;
+				char const *Data = lua_tolstring(State, Position, &Length);
+				Out.WriteByte(TagString);
+				Out.WriteString(Data, Length);
+				return;
+			}
+			case LUA_TTABLE:
+				// Cycles are recorded as unsupported, shared tables are copied
+				if (Visited.insert(lua_topointer(State, Position)).second && lua_checkstack(State, 3))
+				{
+					Position = lua_absindex(State, Position);
+					Out.WriteByte(TagTable);
+					lua_pushnil(State);
+					while (lua_next(State, Position))
+					{
+						WriteValue(Out, State, -2, Visited);
+						WriteValue(Out, State, -1, Visited);
+						lua_pop(State, 1);
+					}
+					Out.WriteByte(TagEnd);
+					Visited.erase(lua_topointer(State, Position));
+					return;
+				}
+				break;
+			default: break;
+		}
+		Out.WriteByte(TagUnsupported);
+		Out.WriteString(lua_typename(State, lua_type(State, Position)));
+	}
+
+	void WriteValues(ScriptBinaryWriter &Out, lua_State *State, int First, int Count)
+	{
+		std::set<void const *> Visited;
+		for (int Position = First; Position < First + Count; Position++)
+			WriteValue(Out, State, Position, Visited);
+	}
+
+	void PushValue(lua_State *State, ScriptBinaryReader &Input, uint8_t Kind)
+	{
+		switch (Kind)
+		{
+			case TagNil: lua_pushnil(State); break;
+			case TagFalse: lua_pushboolean(State, false); break;
+			case TagTrue: lua_pushboolean(State, true); break;
+			case TagNumber: lua_pushnumber(State, Input.ReadNumber()); break;
+			case TagInteger: lua_pushinteger(State, (lua_Integer)Input.ReadLong()); break;
+			case TagString:
+			{
+				String Data = Input.ReadString();
+				lua_pushlstring(State, Data.c_str(), Data.size());
+				break;
+			}
+			case TagTable:
+				if (!lua_checkstack(State, 3)) throw Error::Input("Trace tables are nested too deeply.");
+				lua_newtable(State);
+				while (true)
+				{
+					uint8_t KeyKind = Input.ReadByte();
+					if (KeyKind == TagEnd) break;
+					PushValue(State, Input, KeyKind);
+					PushValue(State, Input, Input.ReadByte());
+					if (lua_isnil(State, -2)) lua_pop(State, 2);
+					else lua_rawset(State, -3);
+				}
+				break;
+			case TagUnsupported: Input.ReadString(); lua_pushnil(State); break;
+			default: throw Error::Input("Trace has an unknown value type.");
+		}
+	}
+
+	// Compares a recorded value with the one at Position.  Tables are compared by content, so iteration order doesn't matter.
+	// Functions, userdata and revisited tables were recorded by type, so only the type is compared.
+	bool MatchValue(lua_State *State, int Position, ScriptBinaryReader &Input, uint8_t Kind)
+	{
+		Position = lua_absindex(State, Position);
+		switch (Kind)
+		{
+			case TagNil: return lua_isnil(State, Position);
+			case TagFalse: return lua_isboolean(State, Position) && !lua_toboolean(State, Position);
+			case TagTrue: return lua_isboolean(State, Position) && lua_toboolean(State, Position);
+			case TagNumber:
+			{
+				double Expected = Input.ReadNumber();
+				if (lua_type(State, Position) != LUA_TNUMBER) return false;
+#if LUA_VERSION_NUM >= 503
+				if (lua_isinteger(State, Position)) return false;
+#endif
+				double Actual = lua_tonumber(State, Position);
+				return (Actual == Expected) || ((Actual != Actual) && (Expected != Expected));
+			}
+			case TagInteger:
+			{
+				lua_Integer Expected = (lua_Integer)Input.ReadLong();
+				if (lua_type(State, Position) != LUA_TNUMBER) return false;
+#if LUA_VERSION_NUM >= 503
+				if (!lua_isinteger(State, Position)) return false;
+#endif
+				return lua_tointeger(State, Position) == Expected;
+			}
+			case TagString:
+			{
+				String Expected = Input.ReadString();
+				if (lua_type(State, Position) != LUA_TSTRING) return false;
+				size_t Length;
+				char const *Actual = lua_tolstring(State, Position, &Length);
+				return Expected.compare(0, String::npos, Actual, Length) == 0;
+			}
+			case TagTable:
+			{
+				if (!lua_checkstack(State, 3)) throw Error::Input("Trace tables are nested too deeply.");
+				bool Matched = lua_istable(State, Position);
+				size_t Entries = 0;
+				while (true)
+				{
+					uint8_t KeyKind = Input.ReadByte();
+					if (KeyKind == TagEnd) break;
+					Entries++;
+					PushValue(State, Input, KeyKind);
+					if (!Matched || lua_istable(State, -1) || lua_isnil(State, -1))
+					{
+						// Copied table keys can't be looked up, just skip the value
+						lua_pop(State, 1);
+						PushValue(State, Input, Input.ReadByte());
+						lua_pop(State, 1);
+						continue;
+					}
+					lua_rawget(State, Position);
+					Matched = MatchValue(State, -1, Input, Input.ReadByte());
+					lua_pop(State, 1);
+				}
+				if (!Matched) return false;
+
+				size_t ActualEntries = 0;
+				lua_pushnil(State);
+				while (lua_next(State, Position))
+				{
+					ActualEntries++;
+					lua_pop(State, 1);
+				}
+				return ActualEntries == Entries;
+			}
+			case TagUnsupported: return Input.ReadString() == lua_typename(State, lua_type(State, Position));
+			default: throw Error::Input("Trace has an unknown value type.");
+		}
+	}
+
+	ScriptTraceReplay::Latency Summarize(std::vector<uint64_t> &Durations)
+	{
+		ScriptTraceReplay::Latency Out = ScriptTraceReplay::Latency();
+		Out.Count = Durations.size();
+		if (Durations.empty()) return Out;
+		std::sort(Durations.begin(), Durations.end());
+		auto Percentile = [&Durations](double Fraction) { return Durations[(size_t)(Fraction * (Durations.size() - 1))]; };
+		Out.Median = Percentile(0.5);
+		Out.Percentile90 = Percentile(0.9);
+		Out.Percentile99 = Percentile(0.99);
+		Out.Percentile999 = Percentile(0.999);
+		Out.Maximum = Durations.back();
+		return Out;
+	}
+}
+
+ScriptTraceRecorder::ScriptTraceRecorder(String const &Filename) :
+	File(Filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc), Started(std::chrono::steady_clock::now()), Depth(0)
+{
+	if (!File) throw Error::System("Couldn't open trace file " + Filename + " for writing.");
+	Buffer.WriteRaw(Magic, 4);
+	Buffer.WriteInteger(Version);
+}
+
+ScriptTraceRecorder::~ScriptTraceRecorder(void)
+	{ Flush(); }
+
+ScriptTraceRecorder::PendingCall ScriptTraceRecorder::BeginDo(void)
+{
+	PendingCall Out;
+	Out.Depth = std::min(Depth++, 255u);
+	Out.ArgumentCount = 0;
+	Out.Start = Now();
+	return Out;
+}
+
+void ScriptTraceRecorder::EndDo(PendingCall const &Call, String const &ScriptName, bool ShowErrors, bool Succeeded)
+{
+	uint64_t const End = Now();
+	Depth--;
+	Buffer.WriteByte(EventDo);
+	Buffer.WriteByte(Call.Depth);
+	Buffer.WriteLong(Call.Start);
+	Buffer.WriteLong(End - Call.Start);
+	Buffer.WriteByte(Succeeded);
+	Buffer.WriteString(ScriptName);
+	Buffer.WriteByte(ShowErrors);
+	if (Buffer.GetData().size() >= FlushSize) Flush();
+}
+
+ScriptTraceRecorder::PendingCall ScriptTraceRecorder::BeginHook(lua_State *State, int Arguments)
+{
+	PendingCall Out;
+	ScriptBinaryWriter Values;
+	WriteValues(Values, State, lua_gettop(State) - Arguments + 1, Arguments);
+	Out.Depth = std::min(Depth++, 255u);
+	Out.ArgumentCount = Arguments;
+	Out.Arguments = Values.GetData();
+	Out.Start = Now();
+	return Out;
+}
+
+void ScriptTraceRecorder::EndHook(PendingCall const &Call, String const &HookName, lua_State *State, int FirstResult, bool Succeeded)
+{
+	uint64_t const End = Now();
+	Depth--;
+	int const Results = lua_gettop(State) - FirstResult + 1;
+	ScriptBinaryWriter Values;
+	Values.WriteInteger(Results);
+	WriteValues(Values, State, FirstResult, Results);
+
+	Buffer.WriteByte(EventHook);
+	Buffer.WriteByte(Call.Depth);
+	Buffer.WriteLong(Call.Start);
+	Buffer.WriteLong(End - Call.Start);
+	Buffer.WriteByte(Succeeded);
+	Buffer.WriteString(HookName);
+	Buffer.WriteInteger(Call.ArgumentCount);
+	Buffer.WriteString(Call.Arguments);
+	Buffer.WriteString(Values.GetData());
+	if (Buffer.GetData().size() >= FlushSize) Flush();
+}
+
+void ScriptTraceRecorder::RecordSave(lua_State *State, String const &Name, bool Global)
+{
+	Buffer.WriteByte(EventSave);
+	Buffer.WriteByte(std::min(Depth, 255u));
+	Buffer.WriteLong(Now());
+	Buffer.WriteLong(0);
+	Buffer.WriteByte(true);
+	Buffer.WriteString(Name);
+	Buffer.WriteByte(Global);
+	Buffer.WriteInteger(lua_gettop(State));
+	Buffer.WriteString(lua_typename(State, lua_type(State, -1)));
+	if (Buffer.GetData().size() >= FlushSize) Flush();
+}
+
+uint64_t ScriptTraceRecorder::Now(void) const
+	{ return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Started).count(); }
+
+void ScriptTraceRecorder::Flush(void)
+{
+	File.write(Buffer.GetData().data(), Buffer.GetData().size());
+	File.flush();
+	Buffer.Clear();
+}
+
+ScriptTraceReplay::ScriptTraceReplay(String const &Filename)
+{
+	String const Contents = ScriptBinaryReadFile(Filename, "trace");
+
+	ScriptBinaryReader Input(Contents);
+	char FileMagic[4];
+	Input.ReadRaw(FileMagic, 4);
+	if (memcmp(FileMagic, Magic, 4) != 0) throw Error::Input(Filename + " is not a script trace.");
+	if (Input.ReadInteger() != Version) throw Error::Input(Filename + " is from an incompatible version.");
+
+	while (!Input.AtEnd())
+	{
+		Event Next;
+		Next.Kind = Input.ReadByte();
+		if ((Next.Kind != EventDo) && (Next.Kind != EventHook) && (Next.Kind != EventSave)) throw Error::Input(Filename + " has an unknown event type.");
+		Next.Depth = Input.ReadByte();
+		Next.Start = Input.ReadLong();
+		Next.Duration = Input.ReadLong();
+		Next.Succeeded = Input.ReadByte();
+		Next.Name = Input.ReadString();
+		Next.ShowErrors = false;
+		Next.Global = false;
+		Next.Height = 0;
+		Next.ArgumentCount = 0;
+		if (Next.Kind == EventDo) Next.ShowErrors = Input.ReadByte();
+		else if (Next.Kind == EventSave)
+		{
+			Next.Global = Input.ReadByte();
+			Next.Height = Input.ReadInteger();
+			Next.Results = Input.ReadString();
+		}
+		else
+		{
+			Next.ArgumentCount = Input.ReadInteger();
+			Next.Arguments = Input.ReadString();
+			Next.Results = Input.ReadString();
+		}
+		Events.push_back(Next);
+	}
+}
+
+ScriptTraceReplay::Report ScriptTraceReplay::Run(Script &Target, bool OriginalPacing) const
+{
+	Report Out = Report();
+	std::vector<uint64_t> RecordedDo, RecordedHooks, ReplayedDo, ReplayedHooks;
+	lua_State *State = Target.GetState();
+
+	auto const Started = std::chrono::steady_clock::now();
+	for (auto &Next : Events)
+	{
+		if (Next.Depth > 0)
+		{
+			Out.Nested++;
+			continue;
+		}
+		if (OriginalPacing) std::this_thread::sleep_until(Started + std::chrono::nanoseconds(Next.Start));
+
+		if (Next.Kind == EventSave)
+		{
+			// Do results stay on the stack until the next Do, so the saved value is found at the same position
+			if ((lua_gettop(State) >= (int)Next.Height) && (Next.Height > 0) && (Next.Results == lua_typename(State, lua_type(State, Next.Height))))
+			{
+				lua_pushvalue(State, Next.Height);
+				if (Next.Global) Target.SaveGlobal(Next.Name);
+				else Target.SaveInternal(Next.Name);
+			}
+			else Out.Failures++;
+		}
+		else if (Next.Kind == EventDo)
+		{
+			Target.ClearStack();
+			auto Start = std::chrono::steady_clock::now();
+			bool Succeeded = Target.Do(Next.Name, Next.ShowErrors);
+			uint64_t const Duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Start).count();
+			if (Next.Succeeded && !Succeeded) Out.Failures++;
+			RecordedDo.push_back(Next.Duration);
+			ReplayedDo.push_back(Duration);
+		}
+		else
+		{
+			int const Base = lua_gettop(State);
+			ScriptBinaryReader Arguments(Next.Arguments);
+			for (uint32_t Argument = 0; Argument < Next.ArgumentCount; Argument++)
+				PushValue(State, Arguments, Arguments.ReadByte());
+
+			auto Start = std::chrono::steady_clock::now();
+			Target.CallHook(Next.Name, Next.ArgumentCount);
+			uint64_t const Duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Start).count();
+
+			// A failed hook leaves the error message, which won't match
+			if (Next.Succeeded)
+			{
+				ScriptBinaryReader Results(Next.Results);
+				bool Matched = (int)Results.ReadInteger() == lua_gettop(State) - Base;
+				for (int Position = Base + 1; Matched && (Position <= lua_gettop(State)); Position++)
+					Matched = MatchValue(State, Position, Results, Results.ReadByte());
+				if (!Matched) Out.Mismatches++;
+			}
+			lua_settop(State, Base);
+			RecordedHooks.push_back(Next.Duration);
+			ReplayedHooks.push_back(Duration);
+		}
+		Out.Events++;
+	}
+	Target.ClearStack();
+	Out.Seconds = std::chrono::duration_cast<std::chrono::duration<double> >(std::chrono::steady_clock::now() - Started).count();
+
+	Out.RecordedDo = Summarize(RecordedDo);
+	Out.RecordedHooks = Summarize(RecordedHooks);
+	Out.ReplayedDo = Summarize(ReplayedDo);
+	Out.ReplayedHooks = Summarize(ReplayedHooks);
+	return Out;
+}
@@ -0,0 +1,96 @@
+#ifndef scripttrace_h
+#define scripttrace_h
+
+// Recording and replaying Do/CallHook traffic
+
+/*
+-- Script::StartRecording logs every Do and CallHook by name on the state to a binary trace: name, arguments, results, start time and duration.
+	SaveInternal and SaveGlobal are logged by stack position, so hooks registered from Do results (Do then SaveInternal) exist when replaying.
+	Calls made from registered functions are logged too, marked as nested.  Calls by reference aren't recorded since references don't
+	survive into another state.
+-- Arguments and results are recorded as plain data.  Tables are copied, functions and userdata are recorded by type and replayed as nil.
+-- ScriptTraceReplay runs a trace against a state as fast as possible or at the recorded pacing, and reports latency percentiles
+	for both the recording and the replay.  Set the state up like the recorded one (registered functions, etc.) before replaying.
+-- Only top-level calls are replayed, nested calls are made again by the calls that contain them.
+-- Replayed hook results are compared with the recorded ones by value, so table iteration order doesn't matter.
+*/
+
+#include "script.h"
+#include "scriptbinary.h"
+
+#include <chrono>
+#include <fstream>
+#include <vector>
+
+class ScriptTraceRecorder
+{
+	public:
+		ScriptTraceRecorder(String const &Filename); // Throws Error::System
+		~ScriptTraceRecorder(void);
+
+		// Arguments are on the top of the stack when beginning a hook, results from FirstResult to the top when ending
+		struct PendingCall
+		{
+			uint64_t Start;
+			uint8_t Depth; // 0 for top-level calls
+			uint32_t ArgumentCount;
+			String Arguments;
+		};
+		PendingCall BeginDo(void);
+		void EndDo(PendingCall const &Call, String const &ScriptName, bool ShowErrors, bool Succeeded);
+		PendingCall BeginHook(lua_State *State, int Arguments);
+		void EndHook(PendingCall const &Call, String const &HookName, lua_State *State, int FirstResult, bool Succeeded);
+		void RecordSave(lua_State *State, String const &Name, bool Global); // The value being saved is on the top of the stack
+
+	private:
+		uint64_t Now(void) const; // Nanoseconds since recording started
+		void Flush(void);
+
+		std::ofstream File;
+		ScriptBinaryWriter Buffer;
+		std::chrono::steady_clock::time_point const Started;
+		unsigned int Depth;
+};
+
+class ScriptTraceReplay
+{
+	public:
+		struct Latency
+		{
+			unsigned long Count;
+			uint64_t Median, Percentile90, Percentile99, Percentile999, Maximum; // Nanoseconds
+		};
+
+		struct Report
+		{
+			unsigned long Events; // Replayed, top-level only
+			unsigned long Nested; // Recorded calls made inside other calls, not replayed directly
+			unsigned long Failures; // Do calls that succeeded when recorded but failed when replayed, and saves whose value wasn't on the stack
+			unsigned long Mismatches; // Hooks that succeeded when recorded but returned different results (or failed) when replayed
+			double Seconds;
+			Latency RecordedDo, RecordedHooks, ReplayedDo, ReplayedHooks;
+		};
+
+		ScriptTraceReplay(String const &Filename); // Throws Error::System if the file can't be read, Error::Input if it's not a trace
+
+		Report Run(Script &Target, bool OriginalPacing = false) const;
+
+	private:
+		struct Event
+		{
+			uint8_t Kind;
+			uint8_t Depth;
+			uint64_t Start, Duration;
+			bool Succeeded;
+			String Name;
+			bool ShowErrors;
+			bool Global; // Saves
+			uint32_t Height; // Saves, stack position of the value
+			uint32_t ArgumentCount;
+			String Arguments, Results; // Results holds the value type for saves
+		};
+
+		std::vector<Event> Events;
+};
+
+#endif